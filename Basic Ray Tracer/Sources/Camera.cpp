@@ -8,7 +8,7 @@
 // ----------------------------------------------
 #include "Camera.h"
 
-inline Ray Camera::rayAt (float x, float y) const {
+Ray Camera::rayAt (float x, float y) const {
 		glm::vec4 p (x, y, 0.f, 1.f);
 		glm::vec4 p2 (x, y, 1.f, 1.f);
 		glm::mat4 viewMatrix = computeViewMatrix ();
@@ -19,3 +19,28 @@ inline Ray Camera::rayAt (float x, float y) const {
 		glm::vec3 direction = glm::normalize (glm::vec3 (pWorld2 / pWorld2.w) - origin);
 		return Ray (origin, direction);
 	}
+
+CameraRayGenerator::CameraRayGenerator (const Camera & camera, size_t width, size_t height) {
+	glm::mat4 invViewMatrix = glm::inverse (camera.computeViewMatrix ());
+	glm::mat4 invViewProjectionMatrix = glm::inverse (camera.computeProjectionMatrix () * camera.computeViewMatrix ());
+	// Directions to the image corners on the far plane, on which unprojection is affine.
+	auto farPoint = [&] (float x, float y) {
+		glm::vec4 p = invViewProjectionMatrix * glm::vec4 (x, y, 1.f, 1.f);
+		return glm::vec3 (p / p.w);
+	};
+	m_eye = glm::vec3 (invViewMatrix * glm::vec4 (0.f, 0.f, 0.f, 1.f));
+	glm::vec3 upperLeft = farPoint (-1.f, 1.f);
+	m_upperLeft = upperLeft - m_eye;
+	m_du = (farPoint (1.f, 1.f) - upperLeft) / float (width);
+	m_dv = (farPoint (-1.f, -1.f) - upperLeft) / float (height);
+}
+
+void CameraRayGenerator::tileRays (size_t x0, size_t y0, size_t x1, size_t y1, std::vector<Ray> & rays) const {
+	rays.clear ();
+	rays.reserve ((x1 - x0) * (y1 - y0));
+	for (size_t y = y0; y < y1; y++) {
+		glm::vec3 rowDirection = m_upperLeft + (float (y) + 0.5f) * m_dv;
+		for (size_t x = x0; x < x1; x++)
+			rays.push_back (Ray (m_eye, glm::normalize (rowDirection + (float (x) + 0.5f) * m_du)));
+	}
+}
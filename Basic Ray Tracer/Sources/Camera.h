@@ -9,6 +9,7 @@
 #pragma once
 
 #include <iostream>
+#include <vector>
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
@@ -16,7 +17,7 @@
 
 #include <glm/gtx/string_cast.hpp>
 
-#include "RayTracer.h"
+#include "Ray.h"
 #include "Transform.h"
 
 /// Basic camera model
@@ -43,6 +44,7 @@ public:
 	/// Returns the projection matrix stemming from the camera intrinsic parameter. 
 	inline glm::mat4 computeProjectionMatrix () const {	return glm::perspective (glm::radians (m_fov), m_aspectRatio, m_near, m_far); }
 
+	/// Returns the primary ray going through the normalized device coordinates (x,y), in [-1,1]^2.
 	Ray rayAt (float x, float y) const;
 
 private:
@@ -53,3 +55,24 @@ private:
 	glm::quat curQuat;
 	glm::quat lastQuat;
 };
+
+/// Primary ray generator for a width x height image, to be built once per frame: the camera matrices are
+/// inverted only here, after which each ray only costs an affine combination of the pixel basis and a normalization.
+class CameraRayGenerator {
+public:
+	CameraRayGenerator (const Camera & camera, size_t width, size_t height);
+
+	inline const glm::vec3 & eye () const { return m_eye; }
+
+	/// Returns the ray going through the image position (x,y), in pixels, (0,0) being the top-left corner of the image.
+	inline Ray rayAt (float x, float y) const { return Ray (m_eye, glm::normalize (m_upperLeft + x * m_du + y * m_dv)); }
+
+	/// Replaces the content of rays by the rays going through the centers of the pixels [x0,x1[ x [y0,y1[, row by row.
+	void tileRays (size_t x0, size_t y0, size_t x1, size_t y1, std::vector<Ray> & rays) const;
+
+private:
+	glm::vec3 m_eye;
+	glm::vec3 m_upperLeft; ///< Direction through the top-left corner of the image.
+	glm::vec3 m_du; ///< Direction offset from one pixel to the next one on the right.
+	glm::vec3 m_dv; ///< Direction offset from one pixel to the next one below.
+};
@@ -0,0 +1,24 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+// Create a Ray class with an origin and a direction.
+class Ray {
+public:
+	Ray (const glm::vec3 & origin, const glm::vec3 & direction) : m_origin (origin), m_direction (direction) {}
+	inline const glm::vec3 & origin () const { return m_origin; }
+	inline const glm::vec3 & direction () const { return m_direction; }
+	inline glm::vec3 pointAtParameter (float t) const { return m_origin + t * m_direction; }
+private:
+	glm::vec3 m_origin;
+	glm::vec3 m_direction;
+};
@@ -12,7 +12,8 @@
 #include "Camera.h"
 
 RayTracer::RayTracer() : 
-	m_imagePtr (std::make_shared<Image>()) {}
+	m_imagePtr (std::make_shared<Image>()),
+	m_tileSchedulerPtr (std::make_shared<TileScheduler>()) {}
 
 RayTracer::~RayTracer() {}
 
@@ -28,19 +29,25 @@ void RayTracer::render (const std::shared_ptr<Scene> scenePtr) {
 	m_imagePtr->clear (scenePtr->backgroundColor ());
 	
 	// <---- Ray tracing code ---->
-	std::shared_ptr<Camera> camera = scenePtr->camera();
-	for (size_t i = 0; i < width; i++) {
-		for (size_t j = 0; j < height; j++) {
-			float x = (2.f * (i + 0.5f) / width - 1.f) * camera->getAspectRatio() * tan(glm::radians(camera->getFoV()) / 2.f);
-			float y = (1.f - 2.f * (j + 0.5f) / height) * tan(glm::radians(camera->getFoV()) / 2.f);
-			Ray ray = camera->rayAt(x, y);
-			m_imagePtr->operator()(i, j) = scenePtr->backgroundColor();
+	CameraRayGenerator rayGenerator (*scenePtr->camera(), width, height);
+	m_tileSchedulerPtr->run (width, height, [&] (const TileScheduler::Tile & tile) {
+		std::vector<Ray> rays;
+		rayGenerator.tileRays (tile.m_x0, tile.m_y0, tile.m_x1, tile.m_y1, rays);
+		// Row-major within the tile, matching the layout of Image.
+		size_t rayIndex = 0;
+		for (size_t j = tile.m_y0; j < tile.m_y1; j++) {
+			for (size_t i = tile.m_x0; i < tile.m_x1; i++)
+				m_imagePtr->operator()(i, j) = sample (scenePtr, rays[rayIndex++]);
 		}
-	}
+	});
 	// <---- Ray tracing code ---->
 
 
 	std::chrono::time_point<std::chrono::high_resolution_clock> after = clock.now();
 	double elapsedTime = (double)std::chrono::duration_cast<std::chrono::milliseconds>(after - before).count();
 	Console::print ("Ray tracing executed in " + std::to_string(elapsedTime) + "ms");
+}
+
+glm::vec3 RayTracer::sample (const std::shared_ptr<Scene> scenePtr, const Ray & /*ray*/) const {
+	return scenePtr->backgroundColor ();
 }
\ No newline at end of file
@@ -19,22 +19,12 @@
 #include <glm/ext.hpp>
 
 #include "Image.h"
+#include "Ray.h"
 #include "Scene.h"
+#include "TileScheduler.h"
 
 using namespace std;
 
-// Create a Ray class with an origin and a direction.
-class Ray {
-public:
-	Ray (const glm::vec3 & origin, const glm::vec3 & direction) : m_origin (origin), m_direction (direction) {}
-	inline const glm::vec3 & origin () const { return m_origin; }
-	inline const glm::vec3 & direction () const { return m_direction; }
-	inline glm::vec3 pointAtParameter (float t) const { return m_origin + t * m_direction; }
-private:
-	glm::vec3 m_origin;
-	glm::vec3 m_direction;
-};
-
 class RayTracer {
 public:
 	
@@ -43,9 +33,15 @@ public:
 
 	inline void setResolution (int width, int height) { m_imagePtr = make_shared<Image> (width, height); }
 	inline std::shared_ptr<Image> image () { return m_imagePtr; }
+	/// Pool of threads rendering the image tile by tile.
+	inline std::shared_ptr<TileScheduler> tileScheduler () { return m_tileSchedulerPtr; }
 	void init (const std::shared_ptr<Scene> scenePtr);
 	void render (const std::shared_ptr<Scene> scenePtr);
 
 private:
+	/// Color seen along a primary ray: the background color until the scene is intersected here.
+	glm::vec3 sample (const std::shared_ptr<Scene> scenePtr, const Ray & ray) const;
+
 	std::shared_ptr<Image> m_imagePtr;
+	std::shared_ptr<TileScheduler> m_tileSchedulerPtr;
 };
\ No newline at end of file
@@ -0,0 +1,243 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#include "BRDFBatch.h"
+
+#include <algorithm>
+
+#include "PBR.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BRDF_BATCH_SSE
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BRDF_BATCH_TARGET_AVX __attribute__ ((target ("avx")))
+#else
+#define BRDF_BATCH_TARGET_AVX
+#endif
+
+using namespace std;
+
+namespace {
+
+// Arrays of a batch, read and written by the kernels below.
+struct BRDFLanes {
+	const float * m_L[3];
+	const float * m_V[3];
+	const float * m_N[3];
+	const float * m_albedo[3];
+	const float * m_roughness;
+	const float * m_metallic;
+	float * m_result[3];
+};
+
+} // namespace
+
+static bool cpuSupportsAVX () {
+#if defined(BRDF_BATCH_SSE) && (defined(__GNUC__) || defined(__clang__))
+	return __builtin_cpu_supports ("avx");
+#elif defined(BRDF_BATCH_SSE) && defined(_MSC_VER)
+	int info[4];
+	__cpuid (info, 1);
+	bool osUsesXSave = (info[2] & (1 << 27)) != 0;
+	bool cpuHasAVX = (info[2] & (1 << 28)) != 0;
+	return osUsesXSave && cpuHasAVX && ((_xgetbv (0) & 0x6) == 0x6);
+#else
+	return false;
+#endif
+}
+
+static void evaluateScalar (const BRDFLanes & lanes, size_t i) {
+	glm::vec3 L (lanes.m_L[0][i], lanes.m_L[1][i], lanes.m_L[2][i]);
+	glm::vec3 V (lanes.m_V[0][i], lanes.m_V[1][i], lanes.m_V[2][i]);
+	glm::vec3 N (lanes.m_N[0][i], lanes.m_N[1][i], lanes.m_N[2][i]);
+	glm::vec3 albedo (lanes.m_albedo[0][i], lanes.m_albedo[1][i], lanes.m_albedo[2][i]);
+	glm::vec3 f = BRDF (L, V, N, albedo, lanes.m_roughness[i], lanes.m_metallic[i]);
+	for (int c = 0; c < 3; c++)
+		lanes.m_result[c][i] = f[c];
+}
+
+// The kernels below follow BRDF operation by operation: std::max (c, x) is max (x, c), which also returns c
+// for x = -0, and divisions stay divisions.
+#ifdef BRDF_BATCH_SSE
+static inline __m128 dotSSE (const __m128 * a, const __m128 * b) {
+	return _mm_add_ps (_mm_add_ps (_mm_mul_ps (a[0], b[0]), _mm_mul_ps (a[1], b[1])), _mm_mul_ps (a[2], b[2]));
+}
+
+static void evaluateSSE (const BRDFLanes & lanes, size_t i) {
+	const __m128 zero = _mm_setzero_ps ();
+	const __m128 one = _mm_set1_ps (1.0f);
+	__m128 L[3], V[3], N[3], H[3], albedo[3], diffuseColor[3], specularColor[3];
+	for (int c = 0; c < 3; c++) {
+		L[c] = _mm_loadu_ps (lanes.m_L[c] + i);
+		V[c] = _mm_loadu_ps (lanes.m_V[c] + i);
+		N[c] = _mm_loadu_ps (lanes.m_N[c] + i);
+		albedo[c] = _mm_loadu_ps (lanes.m_albedo[c] + i);
+	}
+	__m128 roughness = _mm_loadu_ps (lanes.m_roughness + i);
+	__m128 metallic = _mm_loadu_ps (lanes.m_metallic + i);
+	__m128 oneMinusMetallic = _mm_sub_ps (one, metallic);
+	for (int c = 0; c < 3; c++) {
+		diffuseColor[c] = _mm_mul_ps (albedo[c], oneMinusMetallic);
+		specularColor[c] = _mm_add_ps (_mm_mul_ps (_mm_set1_ps (0.08f), oneMinusMetallic), _mm_mul_ps (albedo[c], metallic));
+	}
+	__m128 NdotL = _mm_max_ps (dotSSE (N, L), zero);
+	__m128 NdotV = _mm_max_ps (dotSSE (N, V), zero);
+	for (int c = 0; c < 3; c++)
+		H[c] = _mm_add_ps (L[c], V[c]);
+	__m128 invLength = _mm_div_ps (one, _mm_sqrt_ps (dotSSE (H, H)));
+	for (int c = 0; c < 3; c++)
+		H[c] = _mm_mul_ps (H[c], invLength);
+	__m128 NdotH = _mm_max_ps (dotSSE (N, H), zero);
+	__m128 VdotH = _mm_max_ps (dotSSE (V, H), zero);
+	// GGX.
+	__m128 alpha = _mm_mul_ps (roughness, roughness);
+	__m128 tmp = _mm_div_ps (alpha, _mm_max_ps (_mm_add_ps (_mm_mul_ps (_mm_mul_ps (NdotH, NdotH), _mm_sub_ps (_mm_mul_ps (alpha, alpha), one)), one), _mm_set1_ps (1e-8f)));
+	__m128 D = _mm_mul_ps (_mm_mul_ps (tmp, tmp), _mm_set1_ps (glm::one_over_pi<float>()));
+	__m128 rough = _mm_cmpge_ps (roughness, one);
+	D = _mm_or_ps (_mm_and_ps (rough, _mm_set1_ps (glm::one_over_pi<float>())), _mm_andnot_ps (rough, D));
+	// Schlick weight, lane by lane for the exponential to be the scalar one.
+	float VdotHs[4], weights[4];
+	_mm_storeu_ps (VdotHs, VdotH);
+	for (int j = 0; j < 4; j++)
+		weights[j] = SchlickSGWeight (VdotHs[j]);
+	__m128 sphg = _mm_loadu_ps (weights);
+	// Geometry.
+	__m128 k = _mm_mul_ps (_mm_mul_ps (roughness, roughness), _mm_set1_ps (0.5f));
+	__m128 oneMinusK = _mm_sub_ps (one, k);
+	__m128 G = _mm_mul_ps (_mm_div_ps (one, _mm_add_ps (_mm_mul_ps (NdotL, oneMinusK), k)), _mm_div_ps (one, _mm_add_ps (_mm_mul_ps (NdotV, oneMinusK), k)));
+	__m128 lit = _mm_cmpgt_ps (NdotL, zero);
+	for (int c = 0; c < 3; c++) {
+		__m128 F = _mm_add_ps (specularColor[c], _mm_mul_ps (_mm_sub_ps (one, specularColor[c]), sphg));
+		__m128 fd = _mm_div_ps (_mm_mul_ps (diffuseColor[c], _mm_sub_ps (one, specularColor[c])), _mm_set1_ps (glm::pi<float>()));
+		__m128 fs = _mm_div_ps (_mm_mul_ps (_mm_mul_ps (F, D), G), _mm_set1_ps (4.0f));
+		_mm_storeu_ps (lanes.m_result[c] + i, _mm_and_ps (lit, _mm_add_ps (fd, fs)));
+	}
+}
+
+BRDF_BATCH_TARGET_AVX
+static inline __m256 dotAVX (const __m256 * a, const __m256 * b) {
+	return _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (a[0], b[0]), _mm256_mul_ps (a[1], b[1])), _mm256_mul_ps (a[2], b[2]));
+}
+
+BRDF_BATCH_TARGET_AVX
+static void evaluateAVX (const BRDFLanes & lanes, size_t i) {
+	const __m256 zero = _mm256_setzero_ps ();
+	const __m256 one = _mm256_set1_ps (1.0f);
+	__m256 L[3], V[3], N[3], H[3], albedo[3], diffuseColor[3], specularColor[3];
+	for (int c = 0; c < 3; c++) {
+		L[c] = _mm256_loadu_ps (lanes.m_L[c] + i);
+		V[c] = _mm256_loadu_ps (lanes.m_V[c] + i);
+		N[c] = _mm256_loadu_ps (lanes.m_N[c] + i);
+		albedo[c] = _mm256_loadu_ps (lanes.m_albedo[c] + i);
+	}
+	__m256 roughness = _mm256_loadu_ps (lanes.m_roughness + i);
+	__m256 metallic = _mm256_loadu_ps (lanes.m_metallic + i);
+	__m256 oneMinusMetallic = _mm256_sub_ps (one, metallic);
+	for (int c = 0; c < 3; c++) {
+		diffuseColor[c] = _mm256_mul_ps (albedo[c], oneMinusMetallic);
+		specularColor[c] = _mm256_add_ps (_mm256_mul_ps (_mm256_set1_ps (0.08f), oneMinusMetallic), _mm256_mul_ps (albedo[c], metallic));
+	}
+	__m256 NdotL = _mm256_max_ps (dotAVX (N, L), zero);
+	__m256 NdotV = _mm256_max_ps (dotAVX (N, V), zero);
+	for (int c = 0; c < 3; c++)
+		H[c] = _mm256_add_ps (L[c], V[c]);
+	__m256 invLength = _mm256_div_ps (one, _mm256_sqrt_ps (dotAVX (H, H)));
+	for (int c = 0; c < 3; c++)
+		H[c] = _mm256_mul_ps (H[c], invLength);
+	__m256 NdotH = _mm256_max_ps (dotAVX (N, H), zero);
+	__m256 VdotH = _mm256_max_ps (dotAVX (V, H), zero);
+	// GGX.
+	__m256 alpha = _mm256_mul_ps (roughness, roughness);
+	__m256 tmp = _mm256_div_ps (alpha, _mm256_max_ps (_mm256_add_ps (_mm256_mul_ps (_mm256_mul_ps (NdotH, NdotH), _mm256_sub_ps (_mm256_mul_ps (alpha, alpha), one)), one), _mm256_set1_ps (1e-8f)));
+	__m256 D = _mm256_mul_ps (_mm256_mul_ps (tmp, tmp), _mm256_set1_ps (glm::one_over_pi<float>()));
+	D = _mm256_blendv_ps (D, _mm256_set1_ps (glm::one_over_pi<float>()), _mm256_cmp_ps (roughness, one, _CMP_GE_OQ));
+	// Schlick weight, lane by lane for the exponential to be the scalar one.
+	float VdotHs[8], weights[8];
+	_mm256_storeu_ps (VdotHs, VdotH);
+	for (int j = 0; j < 8; j++)
+		weights[j] = SchlickSGWeight (VdotHs[j]);
+	__m256 sphg = _mm256_loadu_ps (weights);
+	// Geometry.
+	__m256 k = _mm256_mul_ps (_mm256_mul_ps (roughness, roughness), _mm256_set1_ps (0.5f));
+	__m256 oneMinusK = _mm256_sub_ps (one, k);
+	__m256 G = _mm256_mul_ps (_mm256_div_ps (one, _mm256_add_ps (_mm256_mul_ps (NdotL, oneMinusK), k)), _mm256_div_ps (one, _mm256_add_ps (_mm256_mul_ps (NdotV, oneMinusK), k)));
+	__m256 lit = _mm256_cmp_ps (NdotL, zero, _CMP_GT_OQ);
+	for (int c = 0; c < 3; c++) {
+		__m256 F = _mm256_add_ps (specularColor[c], _mm256_mul_ps (_mm256_sub_ps (one, specularColor[c]), sphg));
+		__m256 fd = _mm256_div_ps (_mm256_mul_ps (diffuseColor[c], _mm256_sub_ps (one, specularColor[c])), _mm256_set1_ps (glm::pi<float>()));
+		__m256 fs = _mm256_div_ps (_mm256_mul_ps (_mm256_mul_ps (F, D), G), _mm256_set1_ps (4.0f));
+		_mm256_storeu_ps (lanes.m_result[c] + i, _mm256_and_ps (lit, _mm256_add_ps (fd, fs)));
+	}
+}
+#endif
+
+size_t BRDFBatch::numOfSIMDLanes () {
+#ifdef BRDF_BATCH_SSE
+	static const bool hasAVX = cpuSupportsAVX ();
+	return (hasAVX ? 8 : 4);
+#else
+	return 1;
+#endif
+}
+
+void BRDFBatch::clear () {
+	m_size = 0;
+}
+
+size_t BRDFBatch::push (const glm::vec3 & L, const glm::vec3 & V, const glm::vec3 & N, const glm::vec3 & albedo, float roughness, float metallic) {
+	if (m_size == m_roughness.size ()) {
+		size_t capacity = std::max<size_t> (64, 2 * m_size);
+		for (int c = 0; c < 3; c++) {
+			m_L[c].resize (capacity, 0.f);
+			m_V[c].resize (capacity, 0.f);
+			m_N[c].resize (capacity, 0.f);
+			m_albedo[c].resize (capacity, 0.f);
+			m_result[c].resize (capacity, 0.f);
+		}
+		m_roughness.resize (capacity, 0.f);
+		m_metallic.resize (capacity, 0.f);
+	}
+	for (int c = 0; c < 3; c++) {
+		m_L[c][m_size] = L[c];
+		m_V[c][m_size] = V[c];
+		m_N[c][m_size] = N[c];
+		m_albedo[c][m_size] = albedo[c];
+	}
+	m_roughness[m_size] = roughness;
+	m_metallic[m_size] = metallic;
+	return m_size++;
+}
+
+void BRDFBatch::evaluate () {
+	BRDFLanes lanes;
+	for (int c = 0; c < 3; c++) {
+		lanes.m_L[c] = m_L[c].data ();
+		lanes.m_V[c] = m_V[c].data ();
+		lanes.m_N[c] = m_N[c].data ();
+		lanes.m_albedo[c] = m_albedo[c].data ();
+		lanes.m_result[c] = m_result[c].data ();
+	}
+	lanes.m_roughness = m_roughness.data ();
+	lanes.m_metallic = m_metallic.data ();
+	size_t i = 0;
+#ifdef BRDF_BATCH_SSE
+	if (numOfSIMDLanes () == 8)
+		for (; i + 8 <= m_size; i += 8)
+			evaluateAVX (lanes, i);
+	for (; i + 4 <= m_size; i += 4)
+		evaluateSSE (lanes, i);
+#endif
+	for (; i < m_size; i++)
+		evaluateScalar (lanes, i);
+}
@@ -0,0 +1,51 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+/// A batch of evaluations of BRDF (PBR.h), stored as structure of arrays so that they run 8 lanes at a time with
+/// AVX, 4 with SSE. Every operation of the scalar BRDF is reproduced in the same order, and the exponential of the
+/// Fresnel term is computed lane by lane with SchlickSGWeight, so each result is bit for bit the one of BRDF.
+class BRDFBatch {
+public:
+	BRDFBatch () : m_size (0) {}
+
+	virtual ~BRDFBatch () {}
+
+	inline size_t size () const { return m_size; }
+
+	/// Removes all the evaluations, keeping the memory for the next batch.
+	void clear ();
+
+	/// Appends the evaluation of BRDF (L, V, N, albedo, roughness, metallic) and returns its index.
+	size_t push (const glm::vec3 & L, const glm::vec3 & V, const glm::vec3 & N, const glm::vec3 & albedo, float roughness, float metallic);
+
+	/// Evaluates all the lanes pushed since the last clear.
+	void evaluate ();
+
+	/// Result of the i-th evaluation, once evaluated.
+	inline glm::vec3 result (size_t i) const { return glm::vec3 (m_result[0][i], m_result[1][i], m_result[2][i]); }
+
+	/// Number of lanes evaluated at a time on this CPU: 8 with AVX, 4 with SSE, 1 otherwise.
+	static size_t numOfSIMDLanes ();
+
+private:
+	size_t m_size;
+	std::vector<float> m_L[3];
+	std::vector<float> m_V[3];
+	std::vector<float> m_N[3];
+	std::vector<float> m_albedo[3];
+	std::vector<float> m_roughness;
+	std::vector<float> m_metallic;
+	std::vector<float> m_result[3];
+};
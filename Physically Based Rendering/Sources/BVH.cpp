@@ -9,82 +9,295 @@
 #include "BVH.h"
 
 #include <algorithm>
+#include <cmath>
+#include <limits>
 
 using namespace std;
 
 struct AxisSort {
-  AxisSort(const std::shared_ptr<Scene> scene, size_t axis)
-      : m_scene(scene), m_axis(axis) {}
-  const std::shared_ptr<Scene> m_scene;
+  AxisSort(const BVH::Geometry &geometry, size_t axis)
+      : m_geometry(geometry), m_axis(axis) {}
+  const BVH::Geometry &m_geometry;
   size_t m_axis;
   bool operator()(const std::pair<size_t, size_t> &i,
                   const std::pair<size_t, size_t> &j) {
-    const std::shared_ptr<Mesh> meshi = m_scene->mesh(i.first);
-    const auto &Pi = meshi->vertexPositions();
-    const auto &ti = meshi->triangles()[i.second];
-    glm::mat4 transi = meshi->computeTransformMatrix();
-    glm::vec3 pi = glm::vec3(transi * glm::vec4(Pi[ti[0].positionIndex], 1.0));
-    const std::shared_ptr<Mesh> meshj = m_scene->mesh(j.first);
-    const auto &Pj = meshj->vertexPositions();
-    const auto &tj = meshj->triangles()[j.second];
-    glm::mat4 transj = meshj->computeTransformMatrix();
-    glm::vec3 pj = glm::vec3(transj * glm::vec4(Pj[tj[0].positionIndex], 1.0));
+    const auto &ti = m_geometry.triangleIndices(i.first)[i.second];
+    const auto &tj = m_geometry.triangleIndices(j.first)[j.second];
+    const glm::vec3 &pi = m_geometry.vertexPositions(i.first)[ti[0]];
+    const glm::vec3 &pj = m_geometry.vertexPositions(j.first)[tj[0]];
     return (pi[m_axis] < pj[m_axis]);
   }
 };
 
-BVH::BVH(const std::shared_ptr<Scene> scene)
-    : BVH(scene, makeIndexPairSet(scene)) {}
+// Number of bins per axis evaluated by the SAH split.
+static const size_t NUM_SAH_BINS = 16;
 
-BVH::BVH(const std::shared_ptr<Scene> scene,
-         std::vector<std::pair<size_t, size_t>> &indexPairSet)
-    : BVH(scene, indexPairSet, 0, indexPairSet.size()) {}
+static BoundingBox triangleBounds(const BVH::Geometry &geometry,
+                                  const std::pair<size_t, size_t> &indexPair) {
+  const auto &P = geometry.vertexPositions(indexPair.first);
+  const auto &triangle =
+      geometry.triangleIndices(indexPair.first)[indexPair.second];
+  BoundingBox bbox;
+  bbox.init(P[triangle[0]]);
+  bbox.extendTo(P[triangle[1]]);
+  bbox.extendTo(P[triangle[2]]);
+  return bbox;
+}
+
+// Triangles per leaf below which a node is not split any further.
+static const size_t MAX_LEAF_SIZE = 4;
+
+// Depth after which splits fall back to the median, bounding the tree height
+// (and thus the traversal stack) regardless of the SAH choices.
+static const size_t MAX_SAH_DEPTH = 32;
+
+// Capacity of the traversal stack, enough for MAX_SAH_DEPTH levels followed by
+// median splits of up to 2^32 triangles.
+static const size_t TRAVERSAL_STACK_SIZE = 64;
+
+static_assert(sizeof(BVH::Node) == 32, "BVH nodes are expected to be 32 bytes");
+
+// Number of triangles above which the two subtrees of a node are built as
+// parallel tasks.
+static const size_t PARALLEL_BUILD_CUTOFF = 4096;
+
+// Number of triangles above which the bounding box of a node is computed as a
+// parallel reduction.
+static const size_t PARALLEL_BOUNDS_CUTOFF = 16384;
+
+// Appends the nodes of a subtree built in its own array, shifting the right
+// child references of its interior nodes accordingly.
+static void appendSubtree(std::vector<BVH::Node> &nodes,
+                          const std::vector<BVH::Node> &subtreeNodes) {
+  uint32_t base = uint32_t(nodes.size());
+  for (BVH::Node node : subtreeNodes) {
+    if (!node.isLeaf())
+      node.m_offset += base;
+    nodes.push_back(node);
+  }
+}
+
+BVH::BVH(const std::shared_ptr<Scene> scene, SplitMethod splitMethod) {
+  Geometry geometry;
+  for (size_t i = 0; i < scene->numOfMeshes(); ++i) {
+    geometry.m_vertexPositions.push_back(&scene->worldVertexPositions(i));
+    geometry.m_triangleIndices.push_back(&scene->mesh(i)->triangleIndices());
+  }
+  init(geometry, splitMethod);
+}
+
+BVH::BVH(const std::shared_ptr<const Mesh> mesh, SplitMethod splitMethod) {
+  Geometry geometry;
+  geometry.m_vertexPositions.push_back(&mesh->vertexPositions());
+  geometry.m_triangleIndices.push_back(&mesh->triangleIndices());
+  init(geometry, splitMethod);
+}
+
+void BVH::init(const Geometry &geometry, SplitMethod splitMethod) {
+  m_indexPairs = makeIndexPairSet(geometry);
+  if (m_indexPairs.empty())
+    return;
+  m_nodes.reserve(2 * m_indexPairs.size() / MAX_LEAF_SIZE + 1);
+#pragma omp parallel
+#pragma omp single
+  build(geometry, 0, m_indexPairs.size(), 0, splitMethod, m_nodes);
+  // Gather the vertices of the triangles in leaf order, so that traversal
+  // reads them contiguously.
+  m_triangleVertices.resize(3 * m_indexPairs.size());
+  for (size_t i = 0; i < m_indexPairs.size(); ++i) {
+    const auto &P = geometry.vertexPositions(m_indexPairs[i].first);
+    const auto &triangle = geometry.triangleIndices(
+        m_indexPairs[i].first)[m_indexPairs[i].second];
+    for (size_t j = 0; j < 3; ++j)
+      m_triangleVertices[3 * i + j] = P[triangle[j]];
+  }
+}
+
+BVH::~BVH() {}
+
+size_t BVH::build(const Geometry &geometry, size_t begin, size_t end,
+                  size_t depth, SplitMethod splitMethod,
+                  std::vector<Node> &nodes) {
+  BoundingBox bbox = computeBounds(geometry, begin, end);
 
-BVH::BVH(const std::shared_ptr<Scene> scene,
-         std::vector<std::pair<size_t, size_t>> &indexPairSet, size_t begin,
-         size_t end) {
+  size_t nodeIndex = nodes.size();
+  nodes.push_back(Node());
+  nodes[nodeIndex].m_min = bbox.min();
+  nodes[nodeIndex].m_max = bbox.max();
+  if (end - begin <= MAX_LEAF_SIZE) {
+    nodes[nodeIndex].m_offset = uint32_t(begin);
+    nodes[nodeIndex].m_count = uint16_t(end - begin);
+    nodes[nodeIndex].m_axis = 0;
+    return nodeIndex;
+  }
+
+  size_t axis = bbox.dominantAxis();
+  size_t mid =
+      (splitMethod == SplitMethod::SAH && depth < MAX_SAH_DEPTH
+           ? sahSplit(geometry, m_indexPairs, begin, end, axis)
+           : medianSplit(geometry, m_indexPairs, begin, end, axis));
+  // The left child is stored right after its parent, the right child after
+  // the whole left subtree.
+  size_t rightIndex;
+  if (end - begin >= PARALLEL_BUILD_CUTOFF) {
+    // Both subtrees own disjoint ranges of m_indexPairs, so they can be built
+    // concurrently into their own node arrays and appended afterwards.
+    std::vector<Node> leftNodes;
+    std::vector<Node> rightNodes;
+#pragma omp task shared(leftNodes)
+    build(geometry, begin, mid, depth + 1, splitMethod, leftNodes);
+#pragma omp task shared(rightNodes)
+    build(geometry, mid, end, depth + 1, splitMethod, rightNodes);
+#pragma omp taskwait
+    appendSubtree(nodes, leftNodes);
+    rightIndex = nodes.size();
+    appendSubtree(nodes, rightNodes);
+  } else {
+    build(geometry, begin, mid, depth + 1, splitMethod, nodes);
+    rightIndex = build(geometry, mid, end, depth + 1, splitMethod, nodes);
+  }
+  nodes[nodeIndex].m_offset = uint32_t(rightIndex);
+  nodes[nodeIndex].m_count = 0;
+  nodes[nodeIndex].m_axis = uint16_t(axis);
+  return nodeIndex;
+}
+
+BoundingBox BVH::computeBounds(const Geometry &geometry, size_t begin,
+                               size_t end) const {
+  if (end - begin >= PARALLEL_BOUNDS_CUTOFF) {
+    size_t mid = (begin + end) / 2;
+    BoundingBox leftBBox;
+    BoundingBox rightBBox;
+#pragma omp task shared(leftBBox)
+    leftBBox = computeBounds(geometry, begin, mid);
+#pragma omp task shared(rightBBox)
+    rightBBox = computeBounds(geometry, mid, end);
+#pragma omp taskwait
+    leftBBox.extendTo(rightBBox);
+    return leftBBox;
+  }
+  BoundingBox bbox;
   for (size_t i = begin; i < end; ++i) {
-    const auto &indexPair = indexPairSet[i];
-    const auto mesh = scene->mesh(indexPair.first);
-    const auto &vertexPositions = mesh->vertexPositions();
-    const auto &triangle = mesh->triangles()[indexPair.second];
-    glm::mat4 transform = mesh->computeTransformMatrix();
-    for (size_t j = 0; j < 3; ++j) {
-      const glm::vec3 &p =
-          glm::vec3(transform *
-                    glm::vec4(vertexPositions[triangle[j].positionIndex], 1.0));
-      if (i == begin && j == 0)
-        m_bbox.init(p);
-      else
-        m_bbox.extendTo(p);
-    }
+    BoundingBox triangleBBox = triangleBounds(geometry, m_indexPairs[i]);
+    if (i == begin)
+      bbox = triangleBBox;
+    else
+      bbox.extendTo(triangleBBox);
   }
+  return bbox;
+}
 
+size_t BVH::medianSplit(const Geometry &geometry,
+                        std::vector<std::pair<size_t, size_t>> &indexPairSet,
+                        size_t begin, size_t end, size_t axis) {
   // Using sort (std::sort(indexPairSet.begin() + int(begin),
-  // indexPairSet.begin() + int(end), AxisSort(scene, axis));) is too much work,
+  // indexPairSet.begin() + int(end), AxisSort(geometry, axis));) is too much work,
   // a partial sort is enough.
-  size_t axis = m_bbox.dominantAxis();
-  auto median = indexPairSet.begin() + int(end - begin) / 2;
-  std::nth_element(indexPairSet.begin() + int(begin), median,
-                   indexPairSet.begin() + int(end), AxisSort(scene, axis));
-
-  if (end - begin >= 2) {
-    size_t mid = (end + begin) / 2;
-    m_left = new BVH(scene, indexPairSet, begin, mid);
-    m_right = new BVH(scene, indexPairSet, mid, end);
-  } else {
-    m_meshIndex = indexPairSet[begin].first;
-    m_triangleIndex = indexPairSet[begin].second;
-    m_left = nullptr;
-    m_right = nullptr;
+  size_t mid = (end + begin) / 2;
+  std::nth_element(indexPairSet.begin() + int(begin),
+                   indexPairSet.begin() + int(mid),
+                   indexPairSet.begin() + int(end), AxisSort(geometry, axis));
+  return mid;
+}
+
+size_t BVH::sahSplit(const Geometry &geometry,
+                     std::vector<std::pair<size_t, size_t>> &indexPairSet,
+                     size_t begin, size_t end, size_t dominantAxis) {
+  std::vector<BoundingBox> triangleBBoxes(end - begin);
+  BoundingBox centroidBBox;
+  for (size_t i = begin; i < end; ++i) {
+    triangleBBoxes[i - begin] = triangleBounds(geometry, indexPairSet[i]);
+    if (i == begin)
+      centroidBBox.init(triangleBBoxes[0].center());
+    else
+      centroidBBox.extendTo(triangleBBoxes[i - begin].center());
+  }
+
+  // Bin the triangle centroids along each axis and evaluate the cost of
+  // splitting between every pair of consecutive bins.
+  float bestCost = std::numeric_limits<float>::max();
+  size_t bestAxis = 0;
+  size_t bestBin = 0;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    float extent = centroidBBox.max()[axis] - centroidBBox.min()[axis];
+    if (extent <= 0.f)
+      continue;
+    float binScale = float(NUM_SAH_BINS) / extent;
+    size_t binCounts[NUM_SAH_BINS] = {0};
+    BoundingBox binBBoxes[NUM_SAH_BINS];
+    for (size_t i = 0; i < triangleBBoxes.size(); ++i) {
+      size_t b = std::min(
+          NUM_SAH_BINS - 1,
+          size_t((triangleBBoxes[i].center()[axis] - centroidBBox.min()[axis]) *
+                 binScale));
+      if (binCounts[b]++ == 0)
+        binBBoxes[b] = triangleBBoxes[i];
+      else
+        binBBoxes[b].extendTo(triangleBBoxes[i]);
+    }
+    // Sweep from the right to accumulate the area and count of the right
+    // side, then from the left to evaluate the cost of each split plane.
+    float rightAreas[NUM_SAH_BINS];
+    size_t rightCounts[NUM_SAH_BINS];
+    BoundingBox rightBBox;
+    size_t rightCount = 0;
+    for (size_t b = NUM_SAH_BINS - 1; b > 0; --b) {
+      if (binCounts[b] > 0) {
+        if (rightCount == 0)
+          rightBBox = binBBoxes[b];
+        else
+          rightBBox.extendTo(binBBoxes[b]);
+        rightCount += binCounts[b];
+      }
+      rightAreas[b] = (rightCount > 0 ? rightBBox.area() : 0.f);
+      rightCounts[b] = rightCount;
+    }
+    BoundingBox leftBBox;
+    size_t leftCount = 0;
+    for (size_t b = 0; b < NUM_SAH_BINS - 1; ++b) {
+      if (binCounts[b] > 0) {
+        if (leftCount == 0)
+          leftBBox = binBBoxes[b];
+        else
+          leftBBox.extendTo(binBBoxes[b]);
+        leftCount += binCounts[b];
+      }
+      if (leftCount == 0 || rightCounts[b + 1] == 0)
+        continue;
+      float cost = leftBBox.area() * float(leftCount) +
+                   rightAreas[b + 1] * float(rightCounts[b + 1]);
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestBin = b;
+      }
+    }
   }
+
+  // All centroids fall in the same bin (e.g., coincident triangles).
+  if (bestCost == std::numeric_limits<float>::max())
+    return medianSplit(geometry, indexPairSet, begin, end, dominantAxis);
+
+  float binScale =
+      float(NUM_SAH_BINS) /
+      (centroidBBox.max()[bestAxis] - centroidBBox.min()[bestAxis]);
+  auto midIt = std::partition(
+      indexPairSet.begin() + int(begin), indexPairSet.begin() + int(end),
+      [&](const std::pair<size_t, size_t> &indexPair) {
+        float c = triangleBounds(geometry, indexPair).center()[bestAxis];
+        size_t b = std::min(
+            NUM_SAH_BINS - 1,
+            size_t((c - centroidBBox.min()[bestAxis]) * binScale));
+        return b <= bestBin;
+      });
+  return size_t(midIt - indexPairSet.begin());
 }
 
 std::vector<std::pair<size_t, size_t>>
-BVH::makeIndexPairSet(const std::shared_ptr<Scene> scene) {
+BVH::makeIndexPairSet(const Geometry &geometry) {
   std::vector<std::pair<size_t, size_t>> indexPairSet;
-  for (size_t meshIndex = 0; meshIndex < scene->numOfMeshes(); ++meshIndex) {
-    const auto &T = scene->mesh(meshIndex)->triangles();
+  for (size_t meshIndex = 0; meshIndex < geometry.numOfMeshes(); ++meshIndex) {
+    const auto &T = geometry.triangleIndices(meshIndex);
     for (size_t triangleIndex = 0; triangleIndex < T.size(); ++triangleIndex)
       indexPairSet.push_back(
           std::pair<size_t, size_t>(meshIndex, triangleIndex));
@@ -92,49 +305,356 @@ BVH::makeIndexPairSet(const std::shared_ptr<Scene> scene) {
   return indexPairSet;
 }
 
-BVH::BVH(const BVH &bvh) {
-  m_bbox = bvh.m_bbox;
-  m_meshIndex = bvh.m_meshIndex;
-  m_triangleIndex = bvh.m_triangleIndex;
-  if (bvh.isLeaf()) {
-    m_left = new BVH(*(bvh.m_left));
-    m_right = new BVH(*(bvh.m_right));
-  } else
-    m_left = m_right = nullptr;
+size_t BVH::height() const { return (m_nodes.empty() ? 0 : height(0)); }
+
+size_t BVH::height(size_t nodeIndex) const {
+  const Node &node = m_nodes[nodeIndex];
+  if (node.isLeaf())
+    return 0;
+  return 1 + std::max(height(nodeIndex + 1), height(node.m_offset));
+}
+
+bool BVH::intersect(const Ray &r, Hit &hit, float tMax) const {
+  if (m_nodes.empty())
+    return false;
+  float closest = std::min(tMax, r.tMax());
+  bool intersectionFound = false;
+  // Each stack entry keeps the entry distance of its node box, so that nodes
+  // pushed before a closer hit was found are skipped without a box test.
+  std::pair<uint32_t, float> stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  float n;
+  float f;
+  if (!r.boxIntersect(m_nodes[0].m_min, m_nodes[0].m_max, n, f))
+    return false;
+  stack[stackSize++] = std::make_pair(0u, n);
+  while (stackSize > 0) {
+    --stackSize;
+    if (stack[stackSize].second >= closest)
+      continue;
+    uint32_t nodeIndex = stack[stackSize].first;
+    const Node &node = m_nodes[nodeIndex];
+    if (node.isLeaf()) {
+      for (uint32_t i = node.m_offset; i < node.m_offset + node.m_count; ++i) {
+        float ut, vt, dt;
+        if (triangleIntersect(r, i, ut, vt, dt) && dt > 0.f &&
+            dt < closest) {
+          intersectionFound = true;
+          closest = dt;
+          hit.m_meshIndex = m_indexPairs[i].first;
+          hit.m_triangleIndex = m_indexPairs[i].second;
+          hit.m_uCoord = ut;
+          hit.m_vCoord = vt;
+          hit.m_distance = dt;
+        }
+      }
+    } else {
+      uint32_t leftIndex = nodeIndex + 1;
+      uint32_t rightIndex = node.m_offset;
+      float leftNear, rightNear;
+      bool leftHit = r.boxIntersect(m_nodes[leftIndex].m_min,
+                                    m_nodes[leftIndex].m_max, leftNear, f) &&
+                     leftNear < closest;
+      bool rightHit = r.boxIntersect(m_nodes[rightIndex].m_min,
+                                     m_nodes[rightIndex].m_max, rightNear, f) &&
+                      rightNear < closest;
+      // Push the farther child first so that the nearer one is popped next.
+      if (leftHit && rightHit) {
+        if (leftNear <= rightNear) {
+          stack[stackSize++] = std::make_pair(rightIndex, rightNear);
+          stack[stackSize++] = std::make_pair(leftIndex, leftNear);
+        } else {
+          stack[stackSize++] = std::make_pair(leftIndex, leftNear);
+          stack[stackSize++] = std::make_pair(rightIndex, rightNear);
+        }
+      } else if (leftHit)
+        stack[stackSize++] = std::make_pair(leftIndex, leftNear);
+      else if (rightHit)
+        stack[stackSize++] = std::make_pair(rightIndex, rightNear);
+    }
+  }
+  return intersectionFound;
 }
 
-BVH::~BVH() {
-  if (!isLeaf()) {
-    delete m_left;
-    delete m_right;
+bool BVH::occluded(const Ray &r, float tMax, size_t excludedMeshIndex,
+                   size_t excludedTriangleIndex) const {
+  if (m_nodes.empty())
+    return false;
+  tMax = std::min(tMax, r.tMax());
+  uint32_t stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    uint32_t nodeIndex = stack[--stackSize];
+    const Node &node = m_nodes[nodeIndex];
+    float n;
+    float f;
+    if (!r.boxIntersect(node.m_min, node.m_max, n, f) || n >= tMax)
+      continue;
+    if (node.isLeaf()) {
+      for (uint32_t i = node.m_offset; i < node.m_offset + node.m_count; ++i) {
+        const auto &indexPair = m_indexPairs[i];
+        if (indexPair.first == excludedMeshIndex &&
+            indexPair.second == excludedTriangleIndex)
+          continue;
+        float ut, vt, dt;
+        if (triangleIntersect(r, i, ut, vt, dt) && dt > 0.f &&
+            dt < tMax)
+          return true;
+      }
+    } else {
+      stack[stackSize++] = node.m_offset;
+      stack[stackSize++] = nodeIndex + 1;
+    }
   }
+  return false;
 }
 
-BVH &BVH::operator=(const BVH &bvh) {
-  m_bbox = bvh.m_bbox;
-  m_meshIndex = bvh.m_meshIndex;
-  m_triangleIndex = bvh.m_triangleIndex;
-  if (bvh.isLeaf()) {
-    m_left = new BVH(*(bvh.m_left));
-    m_right = new BVH(*(bvh.m_right));
-  } else
-    m_left = m_right = nullptr;
-  return (*this);
+bool BVH::PacketBounds::compute(const Ray *rays, size_t numOfRays) {
+  if (numOfRays == 0)
+    return false;
+  m_originMin = m_originMax = rays[0].origin();
+  m_invDirectionMin = m_invDirectionMax = rays[0].invDirection();
+  m_tMin = rays[0].tMin();
+  for (size_t i = 0; i < numOfRays; i++) {
+    for (int axis = 0; axis < 3; axis++)
+      if (rays[i].sign(axis) != rays[0].sign(axis) ||
+          !std::isfinite(rays[i].invDirection()[axis]))
+        return false;
+    m_originMin = glm::min(m_originMin, rays[i].origin());
+    m_originMax = glm::max(m_originMax, rays[i].origin());
+    m_invDirectionMin = glm::min(m_invDirectionMin, rays[i].invDirection());
+    m_invDirectionMax = glm::max(m_invDirectionMax, rays[i].invDirection());
+    m_tMin = std::min(m_tMin, rays[i].tMin());
+  }
+  for (int axis = 0; axis < 3; axis++)
+    m_positive[axis] = (rays[0].sign(axis) == 0);
+  return true;
 }
 
-void BVH::intersect(
-    const Ray &r,
-    std::vector<std::pair<size_t, size_t>> &candidateMeshTrianglePairs) const {
-  float n;
-  float f;
-  if (r.boxIntersect(m_bbox.min(), m_bbox.max(), n, f)) {
-    if (isLeaf()) {
-      candidateMeshTrianglePairs.push_back(
-          std::pair<size_t, size_t>(m_meshIndex, m_triangleIndex));
-      return;
+// Lower bound of the distances at which the rays of a packet enter a box, or
+// infinity if none of them overlaps it before tMax. The slab distances are
+// computed as in Ray::boxIntersect, from the interval ends, and rounding is
+// monotonic, so the packet never culls a box that one of its rays would enter.
+static float packetBoxEntry(const BVH::PacketBounds &bounds,
+                            const glm::vec3 &boxMin, const glm::vec3 &boxMax,
+                            float tMax) {
+  float entry = bounds.m_tMin;
+  float exit = tMax;
+  for (int axis = 0; axis < 3; axis++) {
+    float invMin = bounds.m_invDirectionMin[axis];
+    float invMax = bounds.m_invDirectionMax[axis];
+    float nearOffset, farOffset;
+    if (bounds.m_positive[axis]) {
+      nearOffset = boxMin[axis] - bounds.m_originMax[axis];
+      farOffset = boxMax[axis] - bounds.m_originMin[axis];
     } else {
-      m_left->intersect(r, candidateMeshTrianglePairs);
-      m_right->intersect(r, candidateMeshTrianglePairs);
+      nearOffset = boxMax[axis] - bounds.m_originMin[axis];
+      farOffset = boxMin[axis] - bounds.m_originMax[axis];
     }
+    entry = std::max(entry, std::min(nearOffset * invMin, nearOffset * invMax));
+    exit = std::min(exit, std::max(farOffset * invMin, farOffset * invMax));
+  }
+  return (entry <= exit ? entry : std::numeric_limits<float>::infinity());
+}
+
+// Node of a packet traversal with the range of rays [m_first, m_last[ of the
+// packet that may enter it, out of which the first and last ones do.
+struct PacketStackEntry {
+  uint32_t m_nodeIndex;
+  float m_entry; ///< Lower bound of the entry distances of the rays.
+  uint8_t m_first;
+  uint8_t m_last;
+};
+
+void BVH::intersect(const Ray *rays, size_t numOfRays, Hit *hits, bool *found,
+                    float tMax) const {
+  for (; numOfRays > MAX_PACKET_SIZE; numOfRays -= MAX_PACKET_SIZE) {
+    intersect(rays, MAX_PACKET_SIZE, hits, found, tMax);
+    rays += MAX_PACKET_SIZE;
+    hits += MAX_PACKET_SIZE;
+    found += MAX_PACKET_SIZE;
+  }
+  PacketBounds bounds;
+  if (m_nodes.empty() || !bounds.compute(rays, numOfRays)) {
+    for (size_t i = 0; i < numOfRays; i++)
+      found[i] = intersect(rays[i], hits[i], tMax);
+    return;
+  }
+  float closest[MAX_PACKET_SIZE];
+  float maxClosest = 0.f;
+  for (size_t i = 0; i < numOfRays; i++) {
+    closest[i] = std::min(tMax, rays[i].tMax());
+    maxClosest = std::max(maxClosest, closest[i]);
+    found[i] = false;
+  }
+  auto entersNode = [&](size_t i, const Node &node) {
+    float n, f;
+    return rays[i].boxIntersect(node.m_min, node.m_max, n, f) &&
+           n < closest[i];
+  };
+  PacketStackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = PacketStackEntry{
+      0u,
+      packetBoxEntry(bounds, m_nodes[0].m_min, m_nodes[0].m_max, maxClosest),
+      0, uint8_t(numOfRays)};
+  while (stackSize > 0) {
+    PacketStackEntry entry = stack[--stackSize];
+    if (entry.m_entry >= maxClosest)
+      continue;
+    const Node &node = m_nodes[entry.m_nodeIndex];
+    // Coherent rays enter the same nodes, so the first ray tested usually
+    // decides, and the range shrinks on the silhouettes.
+    size_t first = entry.m_first;
+    size_t last = entry.m_last;
+    while (first < last && !entersNode(first, node))
+      first++;
+    if (first == last)
+      continue;
+    while (last - 1 > first && !entersNode(last - 1, node))
+      last--;
+    if (node.isLeaf()) {
+      for (size_t j = first; j < last; j++) {
+        if (j != first && j != last - 1 && !entersNode(j, node))
+          continue;
+        for (uint32_t i = node.m_offset; i < node.m_offset + node.m_count;
+             ++i) {
+          float ut, vt, dt;
+          if (triangleIntersect(rays[j], i, ut, vt, dt) && dt > 0.f &&
+              dt < closest[j]) {
+            found[j] = true;
+            closest[j] = dt;
+            hits[j].m_meshIndex = m_indexPairs[i].first;
+            hits[j].m_triangleIndex = m_indexPairs[i].second;
+            hits[j].m_uCoord = ut;
+            hits[j].m_vCoord = vt;
+            hits[j].m_distance = dt;
+          }
+        }
+      }
+      maxClosest = *std::max_element(closest, closest + numOfRays);
+    } else {
+      // All the rays share the direction sign along the split axis, which
+      // tells the nearer child.
+      uint32_t nearIndex = entry.m_nodeIndex + 1;
+      uint32_t farIndex = node.m_offset;
+      if (!bounds.m_positive[node.m_axis])
+        std::swap(nearIndex, farIndex);
+      float farEntry = packetBoxEntry(bounds, m_nodes[farIndex].m_min,
+                                      m_nodes[farIndex].m_max, maxClosest);
+      if (farEntry < maxClosest)
+        stack[stackSize++] = PacketStackEntry{farIndex, farEntry,
+                                              uint8_t(first), uint8_t(last)};
+      float nearEntry = packetBoxEntry(bounds, m_nodes[nearIndex].m_min,
+                                       m_nodes[nearIndex].m_max, maxClosest);
+      if (nearEntry < maxClosest)
+        stack[stackSize++] = PacketStackEntry{nearIndex, nearEntry,
+                                              uint8_t(first), uint8_t(last)};
+    }
+  }
+}
+
+void BVH::occluded(const Ray *rays, size_t numOfRays, const float *tMax,
+                   const size_t *excludedMeshIndices,
+                   const size_t *excludedTriangleIndices,
+                   bool *occluded) const {
+  for (; numOfRays > MAX_PACKET_SIZE; numOfRays -= MAX_PACKET_SIZE) {
+    this->occluded(rays, MAX_PACKET_SIZE, tMax, excludedMeshIndices,
+                   excludedTriangleIndices, occluded);
+    rays += MAX_PACKET_SIZE;
+    tMax += MAX_PACKET_SIZE;
+    excludedMeshIndices += MAX_PACKET_SIZE;
+    excludedTriangleIndices += MAX_PACKET_SIZE;
+    occluded += MAX_PACKET_SIZE;
+  }
+  PacketBounds bounds;
+  if (m_nodes.empty() || !bounds.compute(rays, numOfRays)) {
+    for (size_t i = 0; i < numOfRays; i++)
+      occluded[i] = this->occluded(rays[i], tMax[i], excludedMeshIndices[i],
+                                   excludedTriangleIndices[i]);
+    return;
+  }
+  // Occluded rays get a null limit, so that they enter no more nodes.
+  float limits[MAX_PACKET_SIZE];
+  float maxLimit = 0.f;
+  for (size_t i = 0; i < numOfRays; i++) {
+    limits[i] = std::min(tMax[i], rays[i].tMax());
+    maxLimit = std::max(maxLimit, limits[i]);
+    occluded[i] = false;
+  }
+  auto entersNode = [&](size_t i, const Node &node) {
+    float n, f;
+    return rays[i].boxIntersect(node.m_min, node.m_max, n, f) &&
+           n < limits[i];
+  };
+  size_t numOfActiveRays = numOfRays;
+  PacketStackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = PacketStackEntry{0u, 0.f, 0, uint8_t(numOfRays)};
+  while (stackSize > 0) {
+    PacketStackEntry entry = stack[--stackSize];
+    const Node &node = m_nodes[entry.m_nodeIndex];
+    if (packetBoxEntry(bounds, node.m_min, node.m_max, maxLimit) >= maxLimit)
+      continue;
+    size_t first = entry.m_first;
+    size_t last = entry.m_last;
+    while (first < last && !entersNode(first, node))
+      first++;
+    if (first == last)
+      continue;
+    while (last - 1 > first && !entersNode(last - 1, node))
+      last--;
+    if (node.isLeaf()) {
+      bool isOccluded = false;
+      for (size_t j = first; j < last; j++) {
+        if (j != first && j != last - 1 && !entersNode(j, node))
+          continue;
+        for (uint32_t i = node.m_offset; i < node.m_offset + node.m_count;
+             ++i) {
+          const auto &indexPair = m_indexPairs[i];
+          if (indexPair.first == excludedMeshIndices[j] &&
+              indexPair.second == excludedTriangleIndices[j])
+            continue;
+          float ut, vt, dt;
+          if (triangleIntersect(rays[j], i, ut, vt, dt) && dt > 0.f &&
+              dt < limits[j]) {
+            occluded[j] = true;
+            limits[j] = 0.f;
+            isOccluded = true;
+            numOfActiveRays--;
+            break;
+          }
+        }
+      }
+      if (numOfActiveRays == 0)
+        return;
+      if (isOccluded)
+        maxLimit = *std::max_element(limits, limits + numOfRays);
+    } else {
+      stack[stackSize++] = PacketStackEntry{node.m_offset, 0.f, uint8_t(first),
+                                            uint8_t(last)};
+      stack[stackSize++] = PacketStackEntry{entry.m_nodeIndex + 1, 0.f,
+                                            uint8_t(first), uint8_t(last)};
+    }
+  }
+}
+
+bool BVH::triangleIntersect(const Ray &r, size_t triangleIndex, float &u,
+                            float &v, float &t) const {
+  const glm::vec3 *p = &m_triangleVertices[3 * triangleIndex];
+  return r.triangleIntersect(p[0], p[1], p[2], u, v, t);
+}
+
+float BVH::sahCost() const {
+  if (m_nodes.empty())
+    return 0.f;
+  float rootArea = bbox().area();
+  float cost = 0.f;
+  for (const Node &node : m_nodes) {
+    float area = BoundingBox(node.m_min, node.m_max).area();
+    float relativeArea = (rootArea > 0.f ? area / rootArea : 1.f);
+    cost += relativeArea * (node.isLeaf() ? float(node.m_count) : 1.f);
   }
+  return cost;
 }
@@ -11,6 +11,8 @@
 #include <vector>
 #include <memory>
 #include <utility>
+#include <cstdint>
+#include <limits>
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
@@ -20,40 +22,123 @@
 #include "Mesh.h"
 #include "Scene.h"
 
+/// Intersection of a ray with a triangle of the scene.
+struct Hit {
+    size_t m_meshIndex;
+    size_t m_triangleIndex;
+    float m_uCoord;
+    float m_vCoord;
+    float m_distance;
+};
+
+/// Bounding volume hierarchy over all the triangles of a scene, stored as a flat array of nodes in depth-first order.
 class BVH {
 public:
-    BVH(const std::shared_ptr<Scene> scene);
-
-    BVH(const BVH& bvh);
+    /// Strategy used to split a node in two children during construction.
+    enum class SplitMethod {
+        Median, ///< Median of the triangles along the dominant axis of the node.
+        SAH     ///< Binned surface area heuristic.
+    };
+
+    /// A 32 bytes node. The left child of an interior node immediately follows it in the array.
+    struct Node {
+        glm::vec3 m_min;
+        uint32_t m_offset; ///< Index of the first triangle for a leaf, of the right child otherwise.
+        glm::vec3 m_max;
+        uint16_t m_count;  ///< Number of triangles for a leaf, 0 otherwise.
+        uint16_t m_axis;   ///< Split axis of an interior node.
+
+        inline bool isLeaf() const { return (m_count > 0); }
+    };
+
+    /// Largest number of rays traversed together by the packet queries.
+    static const size_t MAX_PACKET_SIZE = 64;
+
+    /// Interval bounds, over the rays of a packet, of their origins and inverse directions, with which a box is
+    /// culled for the whole packet at once [Boulos et al. 2006]. Only defined for rays with the same direction signs
+    /// and no null direction component.
+    struct PacketBounds {
+        glm::vec3 m_originMin;
+        glm::vec3 m_originMax;
+        glm::vec3 m_invDirectionMin;
+        glm::vec3 m_invDirectionMax;
+        bool m_positive[3];  ///< Direction sign of the rays along each axis.
+        float m_tMin;
+
+        /// False if the rays do not fulfill the conditions above.
+        bool compute(const Ray* rays, size_t numOfRays);
+    };
+
+    /// Vertex positions and triangles of the meshes a hierarchy is built over, in world or object space.
+    struct Geometry {
+        std::vector<const std::vector<glm::vec3>*> m_vertexPositions;
+        std::vector<const std::vector<glm::uvec3>*> m_triangleIndices;
+
+        inline size_t numOfMeshes() const { return m_vertexPositions.size(); }
+        inline const std::vector<glm::vec3>& vertexPositions(size_t meshIndex) const { return *m_vertexPositions[meshIndex]; }
+        inline const std::vector<glm::uvec3>& triangleIndices(size_t meshIndex) const { return *m_triangleIndices[meshIndex]; }
+    };
+
+    /// Builds the hierarchy from the world-space vertex cache of the scene, which must be up to date.
+    BVH(const std::shared_ptr<Scene> scene, SplitMethod splitMethod = SplitMethod::SAH);
+
+    /// Builds the hierarchy over the triangles of a single mesh in its object space, its transform being ignored.
+    /// Hits and index pairs refer to it as mesh 0.
+    BVH(const std::shared_ptr<const Mesh> mesh, SplitMethod splitMethod = SplitMethod::SAH);
 
     virtual ~BVH();
 
-    BVH& operator= (const BVH& bvh);
+    inline size_t numOfNodes() const { return m_nodes.size(); }
 
-    inline bool isLeaf() const { return (m_left == nullptr); }
+    inline const std::vector<Node>& nodes() const { return m_nodes; }
 
-    inline size_t height () const { return (isLeaf () ? 0 : 1 + std::max (m_left->height(), m_right->height ())); }
+    /// (mesh index, triangle index) pairs, ordered such that each leaf references a contiguous range.
+    inline const std::vector<std::pair<size_t, size_t> >& indexPairs() const { return m_indexPairs; }
 
-    inline const BoundingBox& bbox() const { return m_bbox; }
+    /// Vertices of the triangles, in the space of the build, 3 per entry of indexPairs().
+    inline const std::vector<glm::vec3>& triangleVertices() const { return m_triangleVertices; }
 
-    inline const BVH* left() const { return m_left; }
+    inline BoundingBox bbox() const { return (m_nodes.empty() ? BoundingBox() : BoundingBox(m_nodes[0].m_min, m_nodes[0].m_max)); }
 
-    inline const BVH* right() const { return m_right; }
+    size_t height() const;
 
-    inline size_t meshIndex() const { return m_meshIndex; }
+    /// Closest intersection of r with the scene triangles at a distance in ]0, tMax[, tMax being clipped to r.tMax().
+    /// Children are visited near-first and nodes farther than the current closest hit are skipped.
+    bool intersect(const Ray& r, Hit& hit, float tMax = std::numeric_limits<float>::max()) const;
 
-    inline size_t triangleIndex() const { return m_triangleIndex; }
+    /// Occlusion query: true as soon as any triangle, other than the excluded one, is found at a distance in ]0, tMax[, tMax being clipped to r.tMax().
+    bool occluded(const Ray& r, float tMax = std::numeric_limits<float>::max(),
+                  size_t excludedMeshIndex = std::numeric_limits<size_t>::max(),
+                  size_t excludedTriangleIndex = std::numeric_limits<size_t>::max()) const;
 
-    void intersect(const Ray& r, std::vector<std::pair<size_t,size_t>>& candidateMeshTrianglePairs) const;
-    
-private:
-    BVH(const std::shared_ptr<Scene> scene, std::vector<std::pair<size_t,size_t> >& indexPairSet);
-    BVH(const std::shared_ptr<Scene> scene, std::vector<std::pair<size_t, size_t> >& indexPairSet, size_t begin, size_t end);
-    std::vector<std::pair<size_t, size_t> > makeIndexPairSet(const std::shared_ptr<Scene> scene);
+    /// Closest intersections of a packet of coherent rays, such as the primary rays of a block of pixels: found[i]
+    /// tells whether hits[i] holds the one of rays[i]. Nodes are culled for the whole packet at once, with interval
+    /// bounds of the origins and inverse directions of its rays [Boulos et al. 2006], and only the rays entering a
+    /// leaf box are tested against its triangles. Rays whose direction signs differ are traversed one by one.
+    /// Longer packets are split into packets of MAX_PACKET_SIZE rays.
+    void intersect(const Ray* rays, size_t numOfRays, Hit* hits, bool* found,
+                   float tMax = std::numeric_limits<float>::max()) const;
 
-    BoundingBox m_bbox;
-    BVH* m_left;
-    BVH* m_right;
-    size_t m_meshIndex;
-    size_t m_triangleIndex;
+    /// Occlusion queries of a packet of coherent rays, such as shadow rays toward the same light, each with its
+    /// own distance limit and excluded triangle. The packet stops as soon as all its rays are occluded.
+    void occluded(const Ray* rays, size_t numOfRays, const float* tMax, const size_t* excludedMeshIndices,
+                  const size_t* excludedTriangleIndices, bool* occluded) const;
+
+    /// Expected cost of a random ray traversal according to the surface area heuristic,
+    /// with unit costs for a node traversal and a triangle intersection.
+    float sahCost() const;
+
+private:
+    void init(const Geometry& geometry, SplitMethod splitMethod);
+    size_t build(const Geometry& geometry, size_t begin, size_t end, size_t depth, SplitMethod splitMethod, std::vector<Node>& nodes);
+    BoundingBox computeBounds(const Geometry& geometry, size_t begin, size_t end) const;
+    static std::vector<std::pair<size_t, size_t> > makeIndexPairSet(const Geometry& geometry);
+    static size_t medianSplit(const Geometry& geometry, std::vector<std::pair<size_t, size_t> >& indexPairSet, size_t begin, size_t end, size_t axis);
+    static size_t sahSplit(const Geometry& geometry, std::vector<std::pair<size_t, size_t> >& indexPairSet, size_t begin, size_t end, size_t axis);
+    size_t height(size_t nodeIndex) const;
+    bool triangleIntersect(const Ray& r, size_t triangleIndex, float& u, float& v, float& t) const;
+
+    std::vector<Node> m_nodes;
+    std::vector<std::pair<size_t, size_t> > m_indexPairs;
+    std::vector<glm::vec3> m_triangleVertices; ///< Vertices of the triangles, 3 per entry of m_indexPairs.
 };
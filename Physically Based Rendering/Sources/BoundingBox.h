@@ -0,0 +1,70 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+/// An axis-aligned bounding box, defined by its min and max corners.
+class BoundingBox {
+public:
+	inline BoundingBox () : m_min (0.f), m_max (0.f) {}
+
+	inline BoundingBox (const glm::vec3 & minCorner, const glm::vec3 & maxCorner) : m_min (minCorner), m_max (maxCorner) {}
+
+	inline virtual ~BoundingBox () {}
+
+	inline const glm::vec3 & min () const { return m_min; }
+
+	inline const glm::vec3 & max () const { return m_max; }
+
+	inline glm::vec3 center () const { return 0.5f * (m_min + m_max); }
+
+	inline glm::vec3 size () const { return m_max - m_min; }
+
+	/// Reset the box to the single point p.
+	inline void init (const glm::vec3 & p) { m_min = m_max = p; }
+
+	/// Grow the box so that it contains p.
+	inline void extendTo (const glm::vec3 & p) {
+		for (int i = 0; i < 3; i++) {
+			m_min[i] = std::min (m_min[i], p[i]);
+			m_max[i] = std::max (m_max[i], p[i]);
+		}
+	}
+
+	/// Grow the box so that it contains b.
+	inline void extendTo (const BoundingBox & b) {
+		extendTo (b.m_min);
+		extendTo (b.m_max);
+	}
+
+	/// Area of the box surface, used by the surface area heuristic.
+	inline float area () const {
+		glm::vec3 d = size ();
+		return 2.f * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+	}
+
+	/// Index of the axis along which the box is the largest.
+	inline size_t dominantAxis () const {
+		glm::vec3 d = size ();
+		if (d[0] >= d[1] && d[0] >= d[2])
+			return 0;
+		else if (d[1] >= d[0] && d[1] >= d[2])
+			return 1;
+		else
+			return 2;
+	}
+
+private:
+	glm::vec3 m_min;
+	glm::vec3 m_max;
+};
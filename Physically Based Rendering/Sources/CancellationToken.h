@@ -0,0 +1,26 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <memory>
+#include <atomic>
+
+/// Flag shared by the copies of a token, raised by whoever requests a cancellation and polled by the threads
+/// doing the work, which give up at the next check. A cancelled token stays cancelled: use a new one to restart.
+class CancellationToken {
+public:
+	CancellationToken () : m_cancelled (std::make_shared<std::atomic<bool>> (false)) {}
+
+	inline void cancel () const { m_cancelled->store (true, std::memory_order_relaxed); }
+
+	inline bool isCancelled () const { return m_cancelled->load (std::memory_order_relaxed); }
+
+private:
+	std::shared_ptr<std::atomic<bool>> m_cancelled;
+};
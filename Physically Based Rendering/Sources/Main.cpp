@@ -20,6 +20,7 @@
 #include <cmath>
 #include <memory>
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <filesystem>
 
@@ -62,21 +63,51 @@ static std::string meshFilename;
 
 // Raytraced rendering
 static bool isDisplayRaytracing(false);
+enum class LiveRaytracing { Off, Frame, Progressive };
+static LiveRaytracing liveRaytracing(LiveRaytracing::Off);	// Background ray tracing, restarted whenever the camera, the lights or the window size change
+static glm::mat4 liveViewMatrix(1.0);						// Camera of the running background ray tracing, to restart it when the camera moves
+static glm::mat4 liveProjectionMatrix(1.0);
+static bool isCropMode(false);								// Left button drags select the crop window of the ray tracer instead of rotating the camera
+static bool isCropping(false);
 
 void clear();
 
 void printHelp()
 {
-	Console::print(std::string("Help:\n") + "\tMouse commands:\n" + "\t* Left button: rotate camera\n" + "\t* Middle button: zoom\n" + "\t* Right button: pan camera\n" + "\tKeyboard commands:\n" + "\t* ESC: quit the program\n" + "\t* H: print this help\n" + "\t* F12: reload GPU shaders\n" + "\t* F: decrease field of view\n" + "\t* G: increase field of view\n" + "\t* TAB: switch between rasterization and ray tracing display\n" + "\t* SPACE: execute ray tracing\n");
+	Console::print(std::string("Help:\n") + "\tMouse commands:\n" + "\t* Left button: rotate camera\n" + "\t* Middle button: zoom\n" + "\t* Right button: pan camera\n" + "\tKeyboard commands:\n" + "\t* ESC: quit the program\n" + "\t* H: print this help\n" + "\t* F12: reload GPU shaders\n" + "\t* F: decrease field of view\n" + "\t* G: increase field of view\n" + "\t* TAB: switch between rasterization and ray tracing display\n" + "\t* SPACE: execute ray tracing in the background, restarted when the camera, the lights or the window size change\n" + "\t* T: execute ray tracing refined for one second\n" + "\t* P: toggle progressive ray tracing, refined in the background and restarted when the camera moves\n" + "\t* B: toggle the BVH acceleration of the ray tracer\n" + "\t* M: switch the BVH split method between median and SAH, and rebuild it\n" + "\t* N: benchmark the BVH build time over the number of threads\n" + "\t* L: cycle the BVH node width between 2, 4 and 8, and rebuild it\n" + "\t* U: toggle the two-level BVH, with one object-space BVH per mesh under a top-level BVH over the mesh instances, and rebuild it\n" + "\t* E: rotate the meshes around the vertical axis, only rebuilding the top level of a two-level BVH\n" + "\t* V: benchmark the ray throughput of the binary and wide BVHs\n" + "\t* I: switch the integrator between direct lighting and path tracing\n" + "\t* C: toggle the crop mode, where left button drags select the only region to ray trace, and clear the crop window when leaving it\n" + "\t* K: toggle adaptive sampling of the progressive ray tracing, focused on noisy pixels\n" + "\t* O: cycle the sampler of the pixel samples between independent, stratified, Sobol and blue noise\n" + "\t* X: toggle the wavefront ray tracing, tracing the samples of each tile as a batch sorted by material\n" + "\t* R: cycle the ray packets of the wavefront ray tracing between single rays, 4x4 and 8x8 packets\n" + "\t* Z: benchmark the sample throughput of the per-pixel and wavefront ray tracing\n");
 }
 
-/// Adjust the ray tracer target resolution and runs it.
+/// Restarts the background ray tracing, if any, from the current camera. The frame in flight is cancelled, which takes at most one row of a tile.
+void restartRaytracing()
+{
+	if (liveRaytracing == LiveRaytracing::Off)
+		return;
+	liveViewMatrix = scenePtr->camera()->computeViewMatrix();
+	liveProjectionMatrix = scenePtr->camera()->computeProjectionMatrix();
+	if (liveRaytracing == LiveRaytracing::Progressive)
+		rayTracerPtr->startProgressive(scenePtr);
+	else
+		rayTracerPtr->startRender(scenePtr);
+}
+
+/// Adjust the ray tracer target resolution and runs it in the background.
 void raytrace()
 {
 	int width, height;
 	glfwGetWindowSize(windowPtr, &width, &height);
 	rayTracerPtr->setResolution(width, height);
-	rayTracerPtr->render(scenePtr);
+	liveRaytracing = LiveRaytracing::Frame;
+	restartRaytracing();
+}
+
+/// Adjust the ray tracer target resolution and refines the image for a second.
+void raytraceTimed()
+{
+	int width, height;
+	glfwGetWindowSize(windowPtr, &width, &height);
+	rayTracerPtr->setResolution(width, height);
+	rayTracerPtr->renderUntil(scenePtr, std::chrono::steady_clock::now() + std::chrono::seconds(1));
+	liveRaytracing = LiveRaytracing::Off;
 }
 
 /// Executed each time a key is entered.
@@ -112,6 +143,120 @@ void keyCallback(GLFWwindow *windowPtr, int key, int scancode, int action, int m
 		{
 			raytrace();
 		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_T)
+		{
+			isDisplayRaytracing = true;
+			raytraceTimed();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_P)
+		{
+			bool isProgressive = (liveRaytracing != LiveRaytracing::Progressive);
+			liveRaytracing = (isProgressive ? LiveRaytracing::Progressive : LiveRaytracing::Off);
+			if (isProgressive)
+			{
+				isDisplayRaytracing = true;
+				restartRaytracing();
+			}
+			else
+				rayTracerPtr->cancel();
+			Console::print(std::string("Progressive ray tracing ") + (isProgressive ? "started" : "stopped"));
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_B)
+		{
+			rayTracerPtr->cancel(); // The settings are read by the background ray tracing
+			rayTracerPtr->setUseBVH(!rayTracerPtr->useBVH());
+			Console::print(std::string("BVH ") + (rayTracerPtr->useBVH() ? "enabled" : "disabled"));
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_M)
+		{
+			rayTracerPtr->setBVHSplitMethod(rayTracerPtr->bvhSplitMethod() == BVH::SplitMethod::SAH ? BVH::SplitMethod::Median : BVH::SplitMethod::SAH);
+			rayTracerPtr->init(scenePtr);
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_N)
+		{
+			rayTracerPtr->benchmarkBVHBuild(scenePtr);
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_L)
+		{
+			size_t width = rayTracerPtr->bvhWidth();
+			rayTracerPtr->setBVHWidth(width == 2 ? 4 : (width == 4 ? 8 : 2));
+			rayTracerPtr->init(scenePtr);
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_U)
+		{
+			rayTracerPtr->setTwoLevelBVH(!rayTracerPtr->twoLevelBVH());
+			rayTracerPtr->init(scenePtr);
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_E)
+		{
+			rayTracerPtr->cancel(); // The transforms are read by the background ray tracing
+			for (size_t i = 0; i < scenePtr->numOfMeshes(); i++)
+				scenePtr->transform(i)->setRotation(scenePtr->transform(i)->getRotation() + glm::vec3(0.0, glm::pi<float>() / 12.f, 0.0));
+			rayTracerPtr->updateTransforms(scenePtr);
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_V)
+		{
+			rayTracerPtr->benchmarkBVHTraversal(scenePtr);
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_I)
+		{
+			rayTracerPtr->cancel();
+			bool pathTracing = (rayTracerPtr->integrator() == RayTracer::Integrator::PathTracing);
+			rayTracerPtr->setIntegrator(pathTracing ? RayTracer::Integrator::DirectLighting : RayTracer::Integrator::PathTracing);
+			Console::print(std::string("Integrator: ") + (pathTracing ? "direct lighting" : "path tracing"));
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_C)
+		{
+			isCropMode = !isCropMode;
+			if (!isCropMode && rayTracerPtr->hasCropWindow())
+			{
+				rayTracerPtr->clearCropWindow();
+				restartRaytracing();
+			}
+			Console::print(std::string("Crop mode ") + (isCropMode ? "enabled: drag with the left button to select the region to ray trace" : "disabled"));
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_K)
+		{
+			rayTracerPtr->cancel();
+			rayTracerPtr->setAdaptiveSampling(!rayTracerPtr->adaptiveSampling());
+			Console::print(std::string("Adaptive sampling ") + (rayTracerPtr->adaptiveSampling() ? "enabled" : "disabled"));
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_O)
+		{
+			rayTracerPtr->cancel();
+			rayTracerPtr->setSamplerType(Sampler::Type((int(rayTracerPtr->samplerType()) + 1) % 4));
+			Console::print("Sampler: " + Sampler::name(rayTracerPtr->samplerType()));
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_X)
+		{
+			rayTracerPtr->cancel();
+			rayTracerPtr->setWavefront(!rayTracerPtr->wavefront());
+			Console::print(std::string("Wavefront ray tracing ") + (rayTracerPtr->wavefront() ? "enabled" : "disabled"));
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_R)
+		{
+			rayTracerPtr->cancel();
+			rayTracerPtr->setRayPacketSize(rayTracerPtr->rayPacketSize() == 1 ? 4 : (rayTracerPtr->rayPacketSize() == 4 ? 8 : 1));
+			size_t packetSize = rayTracerPtr->rayPacketSize();
+			Console::print(packetSize == 1 ? std::string("Single ray tracing") : "Ray packets of " + std::to_string(packetSize) + "x" + std::to_string(packetSize) + " rays");
+			restartRaytracing();
+		}
+		else if (action == GLFW_PRESS && key == GLFW_KEY_Z)
+		{
+			rayTracerPtr->benchmarkWavefront(scenePtr);
+			restartRaytracing();
+		}
 
 		// camera translation with W A S D
 		else if (action == GLFW_PRESS && key == GLFW_KEY_W)
@@ -152,12 +297,16 @@ void keyCallback(GLFWwindow *windowPtr, int key, int scancode, int action, int m
 		else if (action == GLFW_PRESS && key == GLFW_KEY_J)
 		{
 			std::cout << scenePtr->pointLights()[0]->getTranslation().x << " " << scenePtr->pointLights()[0]->getTranslation().y << " " << scenePtr->pointLights()[0]->getTranslation().z << std::endl;
+			rayTracerPtr->cancel(); // The light is read by the background ray tracing
 			scenePtr->pointLights()[0]->setTranslation(scenePtr->pointLights()[0]->getTranslation() + glm::vec3(0.1 * meshScale, 0.0, 0.0));
+			restartRaytracing();
 		}
 		else if (action == GLFW_REPEAT && key == GLFW_KEY_J)
 		{
 			std::cout << scenePtr->pointLights()[0]->getTranslation().x << " " << scenePtr->pointLights()[0]->getTranslation().y << " " << scenePtr->pointLights()[0]->getTranslation().z << std::endl;
+			rayTracerPtr->cancel();
 			scenePtr->pointLights()[0]->setTranslation(scenePtr->pointLights()[0]->getTranslation() + glm::vec3(0.1 * meshScale, 0.0, 0.0));
+			restartRaytracing();
 		}
 
 		else
@@ -193,7 +342,34 @@ void cursorPosCallback(GLFWwindow *window, double xpos, double ypos)
 /// Called each time a mouse button is pressed
 void mouseButtonCallback(GLFWwindow *window, int button, int action, int mods)
 {
-	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+	if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && isCropMode)
+	{
+		isCropping = true;
+		glfwGetCursorPos(window, &baseX, &baseY);
+	}
+	else if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE && isCropping)
+	{
+		isCropping = false;
+		double xpos, ypos;
+		glfwGetCursorPos(window, &xpos, &ypos);
+		int width, height;
+		glfwGetWindowSize(window, &width, &height);
+		RayTracer::CropWindow cropWindow;
+		cropWindow.m_x0 = static_cast<size_t>(std::clamp(std::floor(std::min(baseX, xpos)), 0.0, double(width)));
+		cropWindow.m_y0 = static_cast<size_t>(std::clamp(std::floor(std::min(baseY, ypos)), 0.0, double(height)));
+		cropWindow.m_x1 = static_cast<size_t>(std::clamp(std::ceil(std::max(baseX, xpos)), 0.0, double(width)));
+		cropWindow.m_y1 = static_cast<size_t>(std::clamp(std::ceil(std::max(baseY, ypos)), 0.0, double(height)));
+		if (cropWindow.m_x1 > cropWindow.m_x0 && cropWindow.m_y1 > cropWindow.m_y0)
+		{
+			rayTracerPtr->setCropWindow(cropWindow);
+			Console::print("Crop window [" + std::to_string(cropWindow.m_x0) + ", " + std::to_string(cropWindow.m_x1) + "[ x [" + std::to_string(cropWindow.m_y0) + ", " + std::to_string(cropWindow.m_y1) + "[");
+			isDisplayRaytracing = true;
+			if (liveRaytracing == LiveRaytracing::Off)
+				liveRaytracing = LiveRaytracing::Frame;
+			restartRaytracing();
+		}
+	}
+	else if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
 	{
 		if (!isRotating)
 		{
@@ -240,6 +416,7 @@ void windowSizeCallback(GLFWwindow *windowPtr, int width, int height)
 	scenePtr->camera()->setAspectRatio(static_cast<float>(width) / static_cast<float>(height));
 	rasterizerPtr->setResolution(width, height);
 	rayTracerPtr->setResolution(width, height);
+	restartRaytracing();
 }
 
 void initGLFW()
@@ -367,6 +544,7 @@ void init()
 
 void clear()
 {
+	rayTracerPtr->cancel();
 	glfwDestroyWindow(windowPtr);
 	glfwTerminate();
 }
@@ -374,6 +552,8 @@ void clear()
 // The main rendering call
 void render()
 {
+	if (liveRaytracing != LiveRaytracing::Off && (scenePtr->camera()->computeViewMatrix() != liveViewMatrix || scenePtr->camera()->computeProjectionMatrix() != liveProjectionMatrix))
+		restartRaytracing();
 	if (isDisplayRaytracing)
 		rasterizerPtr->display(rayTracerPtr->image());
 	else
@@ -399,6 +579,8 @@ void update(float currentTime)
 		fpsTime = currentTime;
 	}
 	std::string titleWithFPS = BASE_WINDOW_TITLE + " - " + std::to_string(FPS) + "FPS";
+	if (liveRaytracing == LiveRaytracing::Progressive)
+		titleWithFPS += " - " + std::to_string(rayTracerPtr->numOfProgressiveSamples()) + "spp";
 	glfwSetWindowTitle(windowPtr, titleWithFPS.c_str());
 	lastTime = currentTime;
 	frameCount++;
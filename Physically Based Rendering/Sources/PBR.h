@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+inline float sqr (float x) { return x*x; }
+
+inline float GGX (float NdotH, float roughness) {
+	if (roughness >= 1.0f) 
+		return glm::one_over_pi<float>();
+	float alpha = sqr (roughness);
+	float tmp = alpha / std::max(1e-8f,(NdotH*NdotH*(sqr (alpha)-1.0f)+1.0f));
+	return sqr (tmp) * glm::one_over_pi<float>();
+}
+
+/// Spherical Gaussian approximation of the Schlick weight (1 - VdotH)^5.
+inline float SchlickSGWeight (float VdotH) {
+	return exp2 ((-5.55473f*VdotH - 6.98316f) * VdotH);
+}
+
+inline glm::vec3 SchlickSGFresnel (float VdotH, glm::vec3 F0) {
+	float sphg = SchlickSGWeight (VdotH);
+	return F0 + (glm::vec3(1.0f) - F0) * sphg;
+}
+
+inline float smithG_GGX (float NdotV, float alphaG) {
+	return 2.0f/(1.0f + sqrt (1.0f + sqr (alphaG) * (1.0f - sqr (NdotV) / sqr(NdotV))));
+}
+
+inline float G1 (float D, float k) {
+	return 1.0f / (D * (1.0f-k) + k);
+}
+
+inline float geometry (float NdotL, float NdotV, float roughness) {
+	float k = roughness * roughness * 0.5f;
+	return G1(NdotL,k) * G1(NdotV,k);
+}
+
+inline glm::vec3 BRDF (glm::vec3 L, glm::vec3 V, glm::vec3 N,  glm::vec3 albedo, float roughness, float metallic)  {
+	glm::vec3 diffuseColor = albedo * (1.0f - metallic);
+	glm::vec3 specularColor = mix(glm::vec3(0.08f), albedo, metallic);
+
+	float NdotL = std::max (0.0f, dot (N, L));
+	float NdotV = std::max (0.0f, dot (N, V));
+
+	if (NdotL <= 0.0f)
+		return glm::vec3 (0.0f); 
+
+	glm::vec3 H = normalize (L + V);
+	float NdotH = std::max (0.0f, dot (N, H));
+	float VdotH = std::max (0.0f, dot (V, H));
+
+	float D = GGX (NdotH, roughness);
+	glm::vec3  F = SchlickSGFresnel (VdotH, specularColor);
+	float G = geometry (NdotL, NdotV, roughness);
+
+	glm::vec3 fd = diffuseColor * (glm::vec3(1.0f)-specularColor) / glm::pi<float>();
+	glm::vec3 fs = F * D * G / (4.0f);
+
+	return (fd + fs);
+}
+
+inline float luminance (glm::vec3 color) {
+	return dot (color, glm::vec3 (0.2126f, 0.7152f, 0.0722f));
+}
+
+/// Completes the unit vector N into an orthonormal basis (T, B, N) [Duff et al. 2017].
+inline void orthonormalBasis (glm::vec3 N, glm::vec3 & T, glm::vec3 & B) {
+	float s = std::copysign (1.0f, N.z);
+	float a = -1.0f / (s + N.z);
+	float b = N.x * N.y * a;
+	T = glm::vec3 (1.0f + s * sqr (N.x) * a, s * b, -s * N.x);
+	B = glm::vec3 (b, s + sqr (N.y) * a, -N.y);
+}
+
+/// Probability of sampling the specular lobe of the BRDF rather than the diffuse one, after their relative weights.
+inline float specularSamplingProbability (glm::vec3 albedo, float metallic) {
+	glm::vec3 diffuseColor = albedo * (1.0f - metallic);
+	glm::vec3 specularColor = mix (glm::vec3 (0.08f), albedo, metallic);
+	float specularWeight = luminance (specularColor);
+	float diffuseWeight = luminance (diffuseColor * (glm::vec3 (1.0f) - specularColor));
+	return glm::clamp (specularWeight / std::max (1e-8f, specularWeight + diffuseWeight), 0.1f, 0.9f);
+}
+
+/// Solid angle density of the directions L drawn by sampleBRDF.
+inline float BRDFPdf (glm::vec3 L, glm::vec3 V, glm::vec3 N, glm::vec3 albedo, float roughness, float metallic) {
+	float NdotL = dot (N, L);
+	if (NdotL <= 0.0f)
+		return 0.0f;
+	glm::vec3 H = normalize (L + V);
+	float NdotH = std::max (0.0f, dot (N, H));
+	float VdotH = std::max (1e-8f, dot (V, H));
+	float pSpecular = specularSamplingProbability (albedo, metallic);
+	return (1.0f - pSpecular) * NdotL * glm::one_over_pi<float>() + pSpecular * GGX (NdotH, roughness) * NdotH / (4.0f * VdotH);
+}
+
+/// Draws a direction L for the BRDF above from three uniform numbers in [0,1[: u0 selects the lobe, (u1, u2) draw
+/// either a cosine-weighted diffuse direction or the mirror of V around a GGX-distributed half vector.
+/// Returns the density of L over both lobes, 0 when L falls below the surface.
+inline float sampleBRDF (glm::vec3 V, glm::vec3 N, glm::vec3 albedo, float roughness, float metallic, float u0, float u1, float u2, glm::vec3 & L) {
+	glm::vec3 T, B;
+	orthonormalBasis (N, T, B);
+	float phi = 2.0f * glm::pi<float>() * u2;
+	if (u0 < specularSamplingProbability (albedo, metallic)) {
+		float alpha = sqr (roughness);
+		float cosTheta = (roughness >= 1.0f ? std::sqrt (1.0f - u1) : std::sqrt ((1.0f - u1) / (1.0f + (sqr (alpha) - 1.0f) * u1)));
+		float sinTheta = std::sqrt (std::max (0.0f, 1.0f - sqr (cosTheta)));
+		glm::vec3 H = sinTheta * std::cos (phi) * T + sinTheta * std::sin (phi) * B + cosTheta * N;
+		L = reflect (-V, H);
+	} else {
+		float cosTheta = std::sqrt (1.0f - u1);
+		float sinTheta = std::sqrt (u1);
+		L = sinTheta * std::cos (phi) * T + sinTheta * std::sin (phi) * B + cosTheta * N;
+	}
+	return BRDFPdf (L, V, N, albedo, roughness, metallic);
+}
@@ -0,0 +1,73 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <cstdint>
+
+/// Counter-based random numbers: dimension d of sample s of pixel (x, y) is the Philox4x32-10 block cipher
+/// (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", 2011) applied to the counter (x, y, s, d / 4),
+/// lane d % 4. Values are a pure function of (seed, pixel, sample, dimension): they neither depend on the thread
+/// drawing them nor on the order in which pixels are rendered.
+class RandomStream {
+public:
+	inline RandomStream (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t seed = 0) :
+		m_x (x),
+		m_y (y),
+		m_sampleIndex (sampleIndex),
+		m_seed (seed),
+		m_dimension (0) {}
+
+	/// Next dimension to be drawn.
+	inline uint32_t dimension () const { return m_dimension; }
+
+	/// Skips to a given dimension, so that a consumer can own a fixed range of dimensions.
+	inline void setDimension (uint32_t dimension) { m_dimension = dimension; }
+
+	inline uint32_t nextUInt () {
+		if ((m_dimension & ~3u) != m_blockDimension) {
+			m_blockDimension = m_dimension & ~3u;
+			philox (m_x, m_y, m_sampleIndex, m_blockDimension >> 2, m_seed, m_block);
+		}
+		return m_block[m_dimension++ & 3u];
+	}
+
+	/// Uniform in [0, 1[, with 24 bits of precision.
+	inline float next () { return float (nextUInt () >> 8) * (1.f / 16777216.f); }
+
+	/// Philox4x32-10 of the counter (c0, c1, c2, c3) with the key (seed, 0).
+	static inline void philox (uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3, uint32_t seed, uint32_t result[4]) {
+		uint32_t x[4] = { c0, c1, c2, c3 };
+		uint32_t k0 = seed, k1 = 0u;
+		for (int round = 0; round < 10; round++) {
+			uint64_t p0 = uint64_t (0xD2511F53u) * x[0];
+			uint64_t p1 = uint64_t (0xCD9E8D57u) * x[2];
+			uint32_t y0 = uint32_t (p1 >> 32) ^ x[1] ^ k0;
+			uint32_t y1 = uint32_t (p1);
+			uint32_t y2 = uint32_t (p0 >> 32) ^ x[3] ^ k1;
+			uint32_t y3 = uint32_t (p0);
+			x[0] = y0;
+			x[1] = y1;
+			x[2] = y2;
+			x[3] = y3;
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+		for (int i = 0; i < 4; i++)
+			result[i] = x[i];
+	}
+
+private:
+	uint32_t m_x;
+	uint32_t m_y;
+	uint32_t m_sampleIndex;
+	uint32_t m_seed;
+	uint32_t m_dimension;
+	uint32_t m_blockDimension = ~0u; ///< First dimension of m_block, never reached by any dimension when invalid.
+	uint32_t m_block[4] = { 0u, 0u, 0u, 0u };
+};
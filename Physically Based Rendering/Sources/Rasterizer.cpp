@@ -102,7 +102,7 @@ void Rasterizer::render(std::shared_ptr<Scene> scenePtr)
 	{
 		glm::mat4 projectionMatrix = scenePtr->camera()->computeProjectionMatrix();
 		m_pbrShaderProgramPtr->set("projectionMat", projectionMatrix); // Compute the projection matrix of the camera and pass it to the GPU program
-		glm::mat4 modelMatrix = scenePtr->mesh(i)->computeTransformMatrix();
+		glm::mat4 modelMatrix = scenePtr->transform(i)->computeTransformMatrix();
 		glm::mat4 viewMatrix = scenePtr->camera()->computeViewMatrix();
 		m_pbrShaderProgramPtr->set("viewMat", viewMatrix);
 		glm::mat4 modelViewMatrix = viewMatrix * modelMatrix;
@@ -45,27 +45,16 @@ bool Ray::boxIntersect(
 	const glm::vec3& boxMax,
 	float& nearT,
 	float& farT) const {
-	nearT = std::numeric_limits<float>::min();
-	farT = std::numeric_limits<float>::max();
-	glm::vec3 dRcp(1.f / m_direction[0], 1.f / m_direction[1], 1.f / m_direction[2]);
+	const glm::vec3* bounds[2] = { &boxMin, &boxMax };
+	nearT = m_tMin;
+	farT = m_tMax;
 	for (int i = 0; i < 3; i++) {
-		const float direction = m_direction[i];
-		const float origin = m_origin[i];
-		const float minVal = boxMin[i], maxVal = boxMax[i];
-		if (direction == 0) {
-			if (origin < minVal || origin > maxVal)
-				return false;
-		}
-		else {
-			float t1 = (minVal - origin) * dRcp[i];
-			float t2 = (maxVal - origin) * dRcp[i];
-			if (t1 > t2)
-				std::swap(t1, t2);
-			nearT = std::max(t1, nearT);
-			farT = std::min(t2, farT);
-			if (!(nearT <= farT))
-				return false;
-		}
+		float t0 = ((*bounds[m_sign[i]])[i] - m_origin[i]) * m_invDirection[i];
+		float t1 = ((*bounds[1 - m_sign[i]])[i] - m_origin[i]) * m_invDirection[i];
+		// A null direction component gives infinite distances, or NaN when the origin lies on a slab plane,
+		// which these comparisons ignore.
+		nearT = t0 > nearT ? t0 : nearT;
+		farT = t1 < farT ? t1 : farT;
 	}
-	return true;
+	return nearT <= farT;
 }
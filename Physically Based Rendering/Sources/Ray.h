@@ -1,20 +1,45 @@
 #pragma once
 
+#include <cmath>
 #include <limits>
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
 /// A 3D ray with basic intersection primitives for ray tracing.
+/// The inverse direction and its per-axis signs are computed once at construction, since every box test needs them.
+/// Null direction components yield infinite inverses, which the box test handles without special cases.
 class Ray {
 public:
-    inline Ray (const glm::vec3 & origin, const glm::vec3 & direction) : m_origin (origin), m_direction (direction) {}
+    inline Ray (const glm::vec3 & origin,
+                const glm::vec3 & direction,
+                float tMin = 0.f,
+                float tMax = std::numeric_limits<float>::max ())
+        : m_origin (origin),
+          m_direction (direction),
+          m_invDirection (1.f / direction[0], 1.f / direction[1], 1.f / direction[2]),
+          m_tMin (tMin),
+          m_tMax (tMax) {
+        for (int i = 0; i < 3; i++)
+            m_sign[i] = std::signbit (m_invDirection[i]) ? 1 : 0;
+    }
     
     inline ~Ray () {}
 
     inline const glm::vec3 & origin () const { return m_origin; }
     
     inline const glm::vec3 & direction () const { return m_direction; }
+
+    inline const glm::vec3 & invDirection () const { return m_invDirection; }
+
+    /// 1 if the direction goes towards negative values along axis i, 0 otherwise:
+    /// the index of the near bound of a box along this axis in a (min, max) pair.
+    inline int sign (int i) const { return m_sign[i]; }
+
+    /// The valid interval of the ray parameter, to which box tests are clipped.
+    inline float tMin () const { return m_tMin; }
+
+    inline float tMax () const { return m_tMax; }
     
     bool triangleIntersect (const glm::vec3 &p0,
                             const glm::vec3 &p1,
@@ -23,6 +48,7 @@ public:
                             float & v,
                             float & t) const;
     
+    /// Slab test: true if the ray enters the box within [tMin, tMax], with [nearT, farT] the clipped overlap.
     bool boxIntersect (const glm::vec3 & boxMin,
                        const glm::vec3 & boxMax,
                        float & nearT,
@@ -31,5 +57,8 @@ public:
 private:
     glm::vec3 m_origin;
     glm::vec3 m_direction;
+    glm::vec3 m_invDirection;
+    int m_sign[3];
+    float m_tMin;
+    float m_tMax;
 };
-
@@ -10,65 +10,752 @@
 
 #include <chrono>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "BRDFBatch.h"
 #include "Camera.h"
 #include "Console.h"
 #include "PBR.h"
 
-RayTracer::RayTracer() : Renderer(), m_imagePtr(std::make_shared<Image>()) {}
+RayTracer::RayTracer()
+    : Renderer(), m_imagePtr(std::make_shared<Image>()),
+      m_isProgressive(false), m_numOfProgressiveSamples(0),
+      m_tileSchedulerPtr(std::make_shared<TileScheduler>()), m_useBVH(true),
+      m_bvhSplitMethod(BVH::SplitMethod::SAH),
+      m_bvhWidth(WideBVH::preferredWidth()), m_useTwoLevelBVH(false),
+      m_integrator(Integrator::DirectLighting), m_maxPathDepth(5),
+      m_russianRouletteDepth(3), m_seed(0),
+      m_samplerType(Sampler::Type::Sobol), m_wavefront(false),
+      m_rayPacketSize(1), m_rayEpsilon(1e-4f),
+      m_adaptiveSampling(false), m_noiseThreshold(0.02f), m_sampleBudget(256) {}
+
+RayTracer::~RayTracer() { cancel(); }
+
+void RayTracer::init(const std::shared_ptr<Scene> scenePtr) {
+  cancel();
+  std::chrono::high_resolution_clock clock;
+  m_twoLevelBVHPtr.reset();
+  if (m_useTwoLevelBVH) {
+    m_bvhPtr.reset();
+    m_wideBVHPtr.reset();
+    // Instances are traced and shaded from the object-space geometry of their
+    // mesh, so the scene keeps no world-space copy of it.
+    scenePtr->updateTransformCache();
+    scenePtr->clearWorldSpaceGeometry();
+    std::chrono::time_point<std::chrono::high_resolution_clock> before =
+        clock.now();
+    m_twoLevelBVHPtr = std::make_shared<TwoLevelBVH>(
+        scenePtr, m_bvhSplitMethod, m_bvhWidth);
+    std::chrono::time_point<std::chrono::high_resolution_clock> after =
+        clock.now();
+    double elapsedTime =
+        (double)std::chrono::duration_cast<std::chrono::milliseconds>(after -
+                                                                      before)
+            .count();
+    Console::print(
+        "Two-level BVH of " +
+        std::to_string(m_twoLevelBVHPtr->numOfInstances()) +
+        " instances over " +
+        std::to_string(m_twoLevelBVHPtr->numOfBottomLevels()) + " " +
+        std::to_string(m_bvhWidth > 2 ? m_bvhWidth : 2) +
+        "-wide bottom-level BVHs built in " + std::to_string(elapsedTime) +
+        "ms");
+    m_rayEpsilon = std::max(
+        1e-6f, 1e-4f * glm::length(m_twoLevelBVHPtr->bbox().size()));
+    return;
+  }
+  scenePtr->updateWorldSpaceCache();
+  Console::print(std::string("Building BVH with ") +
+                 (m_bvhSplitMethod == BVH::SplitMethod::SAH ? "SAH" : "median") +
+                 " splits...");
+  std::chrono::time_point<std::chrono::high_resolution_clock> before =
+      clock.now();
+  m_bvhPtr = std::make_shared<BVH>(scenePtr, m_bvhSplitMethod);
+  std::chrono::time_point<std::chrono::high_resolution_clock> after =
+      clock.now();
+  double elapsedTime =
+      (double)std::chrono::duration_cast<std::chrono::milliseconds>(after -
+                                                                    before)
+          .count();
+  Console::print("BVH of height " + std::to_string(m_bvhPtr->height()) +
+                 " and SAH cost " + std::to_string(m_bvhPtr->sahCost()) +
+                 " built in " + std::to_string(elapsedTime) + "ms");
+  m_rayEpsilon = std::max(1e-6f, 1e-4f * glm::length(m_bvhPtr->bbox().size()));
+  m_wideBVHPtr.reset();
+  if (m_bvhWidth > 2) {
+    m_wideBVHPtr = std::make_shared<WideBVH>(m_bvhPtr, m_bvhWidth);
+    Console::print("Collapsed into a " + std::to_string(m_wideBVHPtr->width()) +
+                   "-wide BVH of " + std::to_string(m_wideBVHPtr->numOfNodes()) +
+                   " nodes and " + std::to_string(m_wideBVHPtr->numOfLeaves()) +
+                   " triangle packs (" +
+                   (WideBVH::isSIMDWidth(m_wideBVHPtr->width()) ? "SIMD"
+                                                                : "scalar") +
+                   " box and triangle tests)");
+  }
+}
 
-RayTracer::~RayTracer() {}
+void RayTracer::updateTransforms(const std::shared_ptr<Scene> scenePtr) {
+  if (!m_twoLevelBVHPtr) {
+    init(scenePtr);
+    return;
+  }
+  cancel();
+  std::chrono::high_resolution_clock clock;
+  std::chrono::time_point<std::chrono::high_resolution_clock> before =
+      clock.now();
+  scenePtr->updateTransformCache();
+  m_twoLevelBVHPtr->updateInstances(scenePtr);
+  std::chrono::time_point<std::chrono::high_resolution_clock> after =
+      clock.now();
+  double elapsedTime =
+      (double)std::chrono::duration_cast<std::chrono::microseconds>(after -
+                                                                    before)
+          .count();
+  Console::print("Transforms updated and top level of " +
+                 std::to_string(m_twoLevelBVHPtr->numOfTopLevelNodes()) +
+                 " nodes rebuilt in " + std::to_string(elapsedTime) + "us");
+}
 
-void RayTracer::init(const std::shared_ptr<Scene> scenePtr) {}
+void RayTracer::benchmarkBVHBuild(const std::shared_ptr<Scene> scenePtr) {
+  cancel();
+#ifdef _OPENMP
+  int maxNumThreads = omp_get_max_threads();
+#else
+  int maxNumThreads = 1;
+  Console::print("OpenMP is disabled, the BVH is built on a single thread");
+#endif
+  scenePtr->updateWorldSpaceCache();
+  std::chrono::high_resolution_clock clock;
+  for (int numThreads = 1;; numThreads = std::min(2 * numThreads, maxNumThreads)) {
+#ifdef _OPENMP
+    omp_set_num_threads(numThreads);
+#endif
+    std::chrono::time_point<std::chrono::high_resolution_clock> before =
+        clock.now();
+    BVH bvh(scenePtr, m_bvhSplitMethod);
+    std::chrono::time_point<std::chrono::high_resolution_clock> after =
+        clock.now();
+    double elapsedTime =
+        (double)std::chrono::duration_cast<std::chrono::milliseconds>(after -
+                                                                      before)
+            .count();
+    Console::print("BVH of " + std::to_string(bvh.numOfNodes()) +
+                   " nodes built with " + std::to_string(numThreads) +
+                   " thread(s) in " + std::to_string(elapsedTime) + "ms");
+    if (numThreads == maxNumThreads)
+      break;
+  }
+#ifdef _OPENMP
+  omp_set_num_threads(maxNumThreads);
+#endif
+  if (m_twoLevelBVHPtr)
+    scenePtr->clearWorldSpaceGeometry();
+}
+
+void RayTracer::benchmarkBVHTraversal(const std::shared_ptr<Scene> scenePtr) {
+  cancel();
+  if (!m_bvhPtr) {
+    Console::print("No single-level BVH to benchmark, call init first");
+    return;
+  }
+  int width = int(m_imagePtr->width());
+  int height = int(m_imagePtr->height());
+  CameraRayGenerator rayGenerator(*scenePtr->camera(), width, height);
+  std::vector<Ray> rays;
+  rayGenerator.tileRays(0, 0, width, height, rays);
+  std::vector<size_t> widths = {2, 4};
+  if (WideBVH::isSIMDWidth(8))
+    widths.push_back(8);
+  std::chrono::high_resolution_clock clock;
+  for (size_t w : widths) {
+    std::shared_ptr<WideBVH> wideBVHPtr;
+    if (w > 2)
+      wideBVHPtr = std::make_shared<WideBVH>(m_bvhPtr, w);
+    int numOfHits = 0;
+    std::chrono::time_point<std::chrono::high_resolution_clock> before =
+        clock.now();
+#pragma omp parallel for reduction(+ : numOfHits)
+    for (int i = 0; i < int(rays.size()); i++) {
+      Hit hit;
+      if (wideBVHPtr ? wideBVHPtr->intersect(rays[i], hit)
+                     : m_bvhPtr->intersect(rays[i], hit))
+        numOfHits++;
+    }
+    std::chrono::time_point<std::chrono::high_resolution_clock> after =
+        clock.now();
+    double elapsedTime =
+        (double)std::chrono::duration_cast<std::chrono::microseconds>(after -
+                                                                      before)
+            .count();
+    double raysPerSecond = rays.size() / std::max(elapsedTime, 1.0) * 1e6;
+    Console::print(std::to_string(w) + "-wide BVH" +
+                   (w > 2 ? (WideBVH::isSIMDWidth(w) ? " (SIMD)" : " (scalar)")
+                          : std::string()) +
+                   ": " + std::to_string(raysPerSecond * 1e-6) + " Mrays/s, " +
+                   std::to_string(numOfHits) + " hits");
+  }
+  // Packet traversals of the binary BVH, and of the wide one used for rendering.
+  std::vector<std::shared_ptr<WideBVH>> packetBVHs = {nullptr};
+  if (m_wideBVHPtr)
+    packetBVHs.push_back(m_wideBVHPtr);
+  for (size_t packetSize : {4, 8}) {
+    // Rays grouped by blocks of pixels, packetOffsets delimiting the blocks.
+    std::vector<Ray> packetRays;
+    std::vector<size_t> packetOffsets;
+    for (int y = 0; y < height; y += int(packetSize))
+      for (int x = 0; x < width; x += int(packetSize)) {
+        std::vector<Ray> blockRays;
+        rayGenerator.tileRays(x, y, std::min(width, x + int(packetSize)),
+                              std::min(height, y + int(packetSize)),
+                              blockRays);
+        packetOffsets.push_back(packetRays.size());
+        packetRays.insert(packetRays.end(), blockRays.begin(),
+                          blockRays.end());
+      }
+    packetOffsets.push_back(packetRays.size());
+    std::vector<Hit> hits(packetRays.size());
+    std::unique_ptr<bool[]> found(new bool[packetRays.size()]);
+    for (const auto &wideBVHPtr : packetBVHs) {
+      std::chrono::time_point<std::chrono::high_resolution_clock> before =
+          clock.now();
+#pragma omp parallel for schedule(dynamic, 16)
+      for (int i = 0; i < int(packetOffsets.size()) - 1; i++) {
+        size_t offset = packetOffsets[i];
+        size_t numOfRays = packetOffsets[i + 1] - offset;
+        if (wideBVHPtr)
+          wideBVHPtr->intersect(&packetRays[offset], numOfRays, &hits[offset],
+                                &found[offset]);
+        else
+          m_bvhPtr->intersect(&packetRays[offset], numOfRays, &hits[offset],
+                              &found[offset]);
+      }
+      std::chrono::time_point<std::chrono::high_resolution_clock> after =
+          clock.now();
+      int numOfHits = int(
+          std::count(found.get(), found.get() + packetRays.size(), true));
+      double elapsedTime =
+          (double)std::chrono::duration_cast<std::chrono::microseconds>(
+              after - before)
+              .count();
+      double raysPerSecond = rays.size() / std::max(elapsedTime, 1.0) * 1e6;
+      Console::print(
+          std::to_string(packetSize) + "x" + std::to_string(packetSize) +
+          " packets in the " +
+          (wideBVHPtr ? std::to_string(wideBVHPtr->width()) + "-wide"
+                      : std::string("binary")) +
+          " BVH: " + std::to_string(raysPerSecond * 1e-6) + " Mrays/s, " +
+          std::to_string(numOfHits) + " hits");
+    }
+  }
+}
+
+void RayTracer::benchmarkWavefront(const std::shared_ptr<Scene> scenePtr) {
+  cancel();
+  if (!m_bvhPtr && !m_twoLevelBVHPtr) {
+    Console::print("No BVH to benchmark, call init first");
+    return;
+  }
+  const size_t numOfPasses = 4;
+  size_t width = m_imagePtr->width();
+  size_t height = m_imagePtr->height();
+  CameraRayGenerator rayGenerator(*scenePtr->camera(), width, height);
+  std::shared_ptr<Sampler> samplerPtr =
+      Sampler::create(m_samplerType, uint32_t(m_sampleBudget), m_seed);
+  bool wavefront = m_wavefront;
+  std::vector<glm::vec3> sums[2];
+  std::chrono::high_resolution_clock clock;
+  for (int w = 0; w < 2; w++) {
+    m_wavefront = (w == 1);
+    std::vector<PixelStatistics> statistics = initialStatistics(width, height);
+    std::chrono::time_point<std::chrono::high_resolution_clock> before =
+        clock.now();
+    for (size_t pass = 0; pass < numOfPasses; pass++)
+      samplePass(scenePtr, rayGenerator, *samplerPtr, width, height,
+                 statistics, []() { return false; });
+    std::chrono::time_point<std::chrono::high_resolution_clock> after =
+        clock.now();
+    size_t numOfSamples = 0;
+    for (const PixelStatistics &pixel : statistics) {
+      numOfSamples += pixel.m_numOfSamples;
+      sums[w].push_back(pixel.m_sum);
+    }
+    double elapsedTime =
+        (double)std::chrono::duration_cast<std::chrono::microseconds>(after -
+                                                                      before)
+            .count();
+    double samplesPerSecond =
+        numOfSamples / std::max(elapsedTime, 1.0) * 1e6;
+    Console::print(std::string(m_wavefront ? "Wavefront" : "Per-pixel") +
+                   " rendering: " + std::to_string(samplesPerSecond * 1e-6) +
+                   " Msamples/s");
+  }
+  m_wavefront = wavefront;
+  Console::print(std::string("Images ") +
+                 (sums[0] == sums[1] ? "identical" : "different"));
+}
 
 void RayTracer::render(const std::shared_ptr<Scene> scenePtr) {
+  render(scenePtr, CancellationToken());
+}
+
+bool RayTracer::render(const std::shared_ptr<Scene> scenePtr,
+                       const CancellationToken &token) {
+  cancel();
   size_t width = m_imagePtr->width();
   size_t height = m_imagePtr->height();
-  m_imagePtr->clear(scenePtr->backgroundColor());
-  const auto cameraPtr = scenePtr->camera();
-  for (int y = 0; y < height; y++) {
-#pragma omp parallel for
-    for (int x = 0; x < width; x++) {
-      glm::vec3 colorResponse(0.f, 0.f, 0.f);
-      Ray ray = cameraPtr->rayAt((float(x) + 0.5) / width,
-                                 1.f - (float(y) + 0.5) / height);
-      colorResponse += sample(scenePtr, ray, 0, 0);
-      m_imagePtr->operator()(x, y) = colorResponse;
+  return renderFrame(scenePtr,
+                     CameraRayGenerator(*scenePtr->camera(), width, height),
+                     width, height, token);
+}
+
+// Dimensions of a pixel sample: the pixel jitter pair first, then for each path
+// vertex a pair for the BRDF direction, the lobe and the Russian roulette.
+static const uint32_t numOfCameraDimensions = 2;
+static const uint32_t numOfDimensionsPerVertex = 4;
+
+// Calls visit(x, y) on the pixels of the tile, block of blockSize x blockSize
+// pixels after block, so that consecutive primary rays form coherent packets.
+template <typename Visit>
+static void forEachPixelByBlocks(const TileScheduler::Tile &tile,
+                                 size_t blockSize, const Visit &visit) {
+  for (size_t by = tile.m_y0; by < tile.m_y1; by += blockSize)
+    for (size_t bx = tile.m_x0; bx < tile.m_x1; bx += blockSize)
+      for (size_t y = by; y < std::min(by + blockSize, tile.m_y1); y++)
+        for (size_t x = bx; x < std::min(bx + blockSize, tile.m_x1); x++)
+          visit(x, y);
+}
+
+bool RayTracer::renderFrame(const std::shared_ptr<Scene> scenePtr,
+                            const CameraRayGenerator rayGenerator,
+                            size_t width, size_t height,
+                            const CancellationToken token) {
+  std::chrono::high_resolution_clock clock;
+  Console::print("Start ray tracing at " + std::to_string(width) + "x" +
+                 std::to_string(height) + " resolution " +
+                 (m_useBVH ? "with" : "without") + " BVH on " +
+                 std::to_string(m_tileSchedulerPtr->numOfThreads()) +
+                 " thread(s)...");
+  std::chrono::time_point<std::chrono::high_resolution_clock> before =
+      clock.now();
+  auto imagePtr = std::make_shared<Image>(*image());
+  CropWindow region = renderRegion(width, height);
+  bool hasMask = (m_pixelMask.size() == width * height);
+  std::shared_ptr<Sampler> samplerPtr =
+      Sampler::create(m_samplerType, uint32_t(m_sampleBudget), m_seed);
+  bool wavefront = m_wavefront;
+  size_t rayPacketSize = m_rayPacketSize;
+  m_tileSchedulerPtr->run(region, [&](const TileScheduler::Tile &tile) {
+    if (token.isCancelled())
+      return;
+    std::vector<Ray> rays;
+    rayGenerator.tileRays(tile.m_x0, tile.m_y0, tile.m_x1, tile.m_y1, rays);
+    size_t rayIndex = 0;
+    if (wavefront) {
+      std::vector<Ray> batch;
+      std::vector<glm::uvec3> pixelSamples;
+      forEachPixelByBlocks(tile, rayPacketSize, [&](size_t x, size_t y) {
+        if (!hasMask || m_pixelMask[y * width + x]) {
+          batch.push_back(rays[(y - tile.m_y0) * (tile.m_x1 - tile.m_x0) +
+                               (x - tile.m_x0)]);
+          pixelSamples.push_back(glm::uvec3(x, y, 0));
+        }
+      });
+      std::vector<glm::vec3> radiance;
+      if (!traceWavefront(scenePtr, *samplerPtr, batch, pixelSamples,
+                          radiance, [&]() { return token.isCancelled(); }))
+        return;
+      for (size_t i = 0; i < radiance.size(); i++)
+        imagePtr->operator()(pixelSamples[i].x, pixelSamples[i].y) =
+            radiance[i];
+      return;
+    }
+    for (size_t y = tile.m_y0; y < tile.m_y1; y++) {
+      if (token.isCancelled())
+        return;
+      for (size_t x = tile.m_x0; x < tile.m_x1; x++, rayIndex++) {
+        if (hasMask && !m_pixelMask[y * width + x])
+          continue;
+        glm::vec3 colorResponse(0.f, 0.f, 0.f);
+        // Rays through the pixel centers: the camera dimensions are skipped.
+        PixelSample pixelSample(*samplerPtr, uint32_t(x), uint32_t(y), 0,
+                                numOfCameraDimensions);
+        colorResponse += sample(scenePtr, rays[rayIndex], pixelSample);
+        imagePtr->operator()(x, y) = colorResponse;
+      }
+    }
+  });
+  if (token.isCancelled()) {
+    Console::print("Ray tracing cancelled");
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_imageMutex);
+    m_imagePtr = imagePtr;
+  }
+  std::chrono::time_point<std::chrono::high_resolution_clock> after =
+      clock.now();
+  double elapsedTime =
+      (double)std::chrono::duration_cast<std::chrono::milliseconds>(after -
+                                                                    before)
+          .count();
+  Console::print("Ray tracing executed in " + std::to_string(elapsedTime) +
+                 "ms");
+  return true;
+}
+
+void RayTracer::startRender(const std::shared_ptr<Scene> scenePtr) {
+  cancel();
+  size_t width = m_imagePtr->width();
+  size_t height = m_imagePtr->height();
+  m_backgroundToken = CancellationToken();
+  m_backgroundThread =
+      std::thread(&RayTracer::renderFrame, this, scenePtr,
+                  CameraRayGenerator(*scenePtr->camera(), width, height),
+                  width, height, m_backgroundToken);
+}
+
+void RayTracer::startProgressive(const std::shared_ptr<Scene> scenePtr) {
+  cancel();
+  size_t width = m_imagePtr->width();
+  size_t height = m_imagePtr->height();
+  m_backgroundToken = CancellationToken();
+  m_isProgressive = true;
+  m_numOfProgressiveSamples = 0;
+  m_backgroundThread =
+      std::thread(&RayTracer::progressiveLoop, this, scenePtr,
+                  CameraRayGenerator(*scenePtr->camera(), width, height),
+                  width, height, m_backgroundToken);
+}
+
+void RayTracer::cancel() {
+  m_backgroundToken.cancel();
+  if (m_backgroundThread.joinable())
+    m_backgroundThread.join();
+  m_isProgressive = false;
+}
+
+// Number of samples of every pixel before adaptive sampling estimates its
+// noise.
+static const uint32_t minNumOfAdaptiveSamples = 8;
+// Cap on the samples of a pixel relative to the average budget, so that a few
+// pixels with rare fireflies cannot take the whole budget.
+static const size_t maxAdaptiveSampleFactor = 16;
+
+RayTracer::CropWindow RayTracer::renderRegion(size_t width,
+                                              size_t height) const {
+  if (!m_hasCropWindow)
+    return CropWindow{0, 0, width, height};
+  CropWindow region = m_cropWindow;
+  region.m_x1 = std::min(region.m_x1, width);
+  region.m_y1 = std::min(region.m_y1, height);
+  region.m_x0 = std::min(region.m_x0, region.m_x1);
+  region.m_y0 = std::min(region.m_y0, region.m_y1);
+  return region;
+}
+
+std::vector<RayTracer::PixelStatistics>
+RayTracer::initialStatistics(size_t width, size_t height) const {
+  std::vector<PixelStatistics> statistics(
+      width * height,
+      PixelStatistics{glm::vec3(0.f), 0.f, 0.f, 0, false, false});
+  CropWindow region = renderRegion(width, height);
+  bool hasMask = (m_pixelMask.size() == width * height);
+  for (size_t y = region.m_y0; y < region.m_y1; y++)
+    for (size_t x = region.m_x0; x < region.m_x1; x++) {
+      PixelStatistics &pixel = statistics[y * width + x];
+      pixel.m_selected = (!hasMask || m_pixelMask[y * width + x]);
+      pixel.m_active = pixel.m_selected;
+    }
+  return statistics;
+}
+
+bool RayTracer::samplePass(const std::shared_ptr<Scene> scenePtr,
+                           const CameraRayGenerator &rayGenerator,
+                           const Sampler &sampler, size_t width,
+                           size_t height,
+                           std::vector<PixelStatistics> &statistics,
+                           const std::function<bool()> &interrupted) {
+  std::atomic<bool> isInterrupted(false);
+  CropWindow region = renderRegion(width, height);
+  bool wavefront = m_wavefront;
+  size_t rayPacketSize = m_rayPacketSize;
+  auto addSample = [](PixelStatistics &pixel, const glm::vec3 &color) {
+    uint32_t n = pixel.m_numOfSamples;
+    float l = luminance(color);
+    float delta = l - pixel.m_luminanceMean;
+    pixel.m_sum += color;
+    pixel.m_numOfSamples = n + 1;
+    pixel.m_luminanceMean += delta / float(n + 1);
+    pixel.m_luminanceM2 += delta * (l - pixel.m_luminanceMean);
+  };
+  m_tileSchedulerPtr->run(region, [&](const TileScheduler::Tile &tile) {
+    if (wavefront) {
+      // The tile is a single batch, given up as a whole if interrupted.
+      if (isInterrupted || interrupted()) {
+        isInterrupted = true;
+        return;
+      }
+      std::vector<Ray> rays;
+      std::vector<glm::uvec3> pixelSamples;
+      forEachPixelByBlocks(tile, rayPacketSize, [&](size_t x, size_t y) {
+        const PixelStatistics &pixel = statistics[y * width + x];
+        if (!pixel.m_active)
+          return;
+        PixelSample pixelSample(sampler, uint32_t(x), uint32_t(y),
+                                pixel.m_numOfSamples);
+        glm::vec2 offset = pixelSample.next2D();
+        rays.push_back(rayGenerator.rayAt(x + offset.x, y + offset.y));
+        pixelSamples.push_back(glm::uvec3(x, y, pixel.m_numOfSamples));
+      });
+      std::vector<glm::vec3> radiance;
+      if (!traceWavefront(scenePtr, sampler, rays, pixelSamples, radiance,
+                          [&]() { return isInterrupted || interrupted(); })) {
+        isInterrupted = true;
+        return;
+      }
+      for (size_t i = 0; i < radiance.size(); i++)
+        addSample(statistics[pixelSamples[i].y * width + pixelSamples[i].x],
+                  radiance[i]);
+      return;
+    }
+    for (size_t y = tile.m_y0; y < tile.m_y1; y++) {
+      if (isInterrupted || interrupted()) {
+        isInterrupted = true;
+        return;
+      }
+      for (size_t x = tile.m_x0; x < tile.m_x1; x++) {
+        PixelStatistics &pixel = statistics[y * width + x];
+        if (!pixel.m_active)
+          continue;
+        uint32_t n = pixel.m_numOfSamples;
+        PixelSample pixelSample(sampler, uint32_t(x), uint32_t(y), n);
+        glm::vec2 offset = pixelSample.next2D();
+        addSample(pixel, sample(scenePtr,
+                                rayGenerator.rayAt(x + offset.x, y + offset.y),
+                                pixelSample));
+      }
+    }
+  });
+  return !isInterrupted;
+}
+
+size_t
+RayTracer::updateActivePixels(size_t width, size_t height,
+                              float noiseThreshold, size_t maxNumOfSamples,
+                              std::vector<PixelStatistics> &statistics) const {
+  // Outliers are rare by nature, so a pixel may look converged before its
+  // first one: pixels are kept active as long as a neighbor is still noisy.
+  CropWindow region = renderRegion(width, height);
+  std::vector<uint8_t> noisy(width * height);
+  for (size_t y = region.m_y0; y < region.m_y1; y++)
+    for (size_t x = region.m_x0; x < region.m_x1; x++) {
+      const PixelStatistics &pixel = statistics[y * width + x];
+      if (!pixel.m_active || pixel.m_numOfSamples >= maxNumOfSamples)
+        continue;
+      float n = float(pixel.m_numOfSamples);
+      float standardError = std::sqrt(pixel.m_luminanceM2 / ((n - 1.f) * n));
+      noisy[y * width + x] =
+          (standardError >
+           noiseThreshold * std::max(pixel.m_luminanceMean, 1e-2f));
     }
+  size_t numOfActivePixels = 0;
+  for (size_t y = region.m_y0; y < region.m_y1; y++)
+    for (size_t x = region.m_x0; x < region.m_x1; x++) {
+      bool active = false;
+      for (size_t j = (y > 0 ? y - 1 : 0); j < std::min(height, y + 2); j++)
+        for (size_t i = (x > 0 ? x - 1 : 0); i < std::min(width, x + 2); i++)
+          active = active || noisy[j * width + i];
+      PixelStatistics &pixel = statistics[y * width + x];
+      pixel.m_active = pixel.m_selected && active &&
+                       pixel.m_numOfSamples < maxNumOfSamples;
+      if (pixel.m_active)
+        numOfActivePixels++;
+    }
+  return numOfActivePixels;
+}
+
+void RayTracer::refine(
+    const std::shared_ptr<Scene> scenePtr,
+    const CameraRayGenerator &rayGenerator, size_t width, size_t height,
+    std::vector<PixelStatistics> &statistics,
+    const std::function<bool()> &interrupted,
+    const std::function<void(size_t, size_t)> &passCompleted) {
+  bool adaptive = m_adaptiveSampling;
+  float noiseThreshold = m_noiseThreshold;
+  size_t numOfActivePixels = 0;
+  for (const PixelStatistics &pixel : statistics)
+    if (pixel.m_active)
+      numOfActivePixels++;
+  size_t numOfSelectedPixels = numOfActivePixels;
+  size_t budget = m_sampleBudget * numOfSelectedPixels;
+  size_t numOfSamples = 0;
+  std::shared_ptr<Sampler> samplerPtr =
+      Sampler::create(m_samplerType, uint32_t(m_sampleBudget), m_seed);
+  for (size_t pass = 0; numOfActivePixels > 0; pass++) {
+    if (adaptive && numOfSamples + numOfActivePixels > budget)
+      break;
+    if (!samplePass(scenePtr, rayGenerator, *samplerPtr, width, height,
+                    statistics, interrupted))
+      return;
+    numOfSamples += numOfActivePixels;
+    size_t numOfSampledPixels = numOfActivePixels;
+    if (adaptive && pass + 1 >= minNumOfAdaptiveSamples)
+      numOfActivePixels = updateActivePixels(
+          width, height, noiseThreshold,
+          maxAdaptiveSampleFactor * m_sampleBudget, statistics);
+    passCompleted(pass + 1, numOfSampledPixels);
+  }
+  if (adaptive)
+    Console::print(
+        "Adaptive sampling " +
+        std::string(numOfActivePixels == 0 ? "converged" : "ran out of budget") +
+        " with " +
+        std::to_string(double(numOfSamples) /
+                       double(std::max<size_t>(1, numOfSelectedPixels))) +
+        " samples per pixel on average");
+}
+
+std::shared_ptr<Image>
+RayTracer::resolve(const std::vector<PixelStatistics> &statistics,
+                   const Image &baseImage) const {
+  auto imagePtr = std::make_shared<Image>(baseImage);
+  for (size_t i = 0; i < statistics.size(); i++)
+    if (statistics[i].m_numOfSamples > 0)
+      (*imagePtr)[i] =
+          statistics[i].m_sum / float(statistics[i].m_numOfSamples);
+  return imagePtr;
+}
+
+void RayTracer::progressiveLoop(const std::shared_ptr<Scene> scenePtr,
+                                const CameraRayGenerator rayGenerator,
+                                size_t width, size_t height,
+                                const CancellationToken token) {
+  std::vector<PixelStatistics> statistics = initialStatistics(width, height);
+  size_t numOfSelectedPixels = 0;
+  for (const PixelStatistics &pixel : statistics)
+    if (pixel.m_selected)
+      numOfSelectedPixels++;
+  std::shared_ptr<const Image> baseImagePtr = image();
+  std::chrono::high_resolution_clock clock;
+  auto lastPublication = clock.now();
+  bool isPublished = true;
+  // An interrupted pass is left out of the average.
+  refine(
+      scenePtr, rayGenerator, width, height, statistics,
+      [&]() { return token.isCancelled(); },
+      [&](size_t numOfPasses, size_t numOfSampledPixels) {
+        m_numOfProgressiveSamples = numOfPasses;
+        // Passes over a handful of pixels are much faster than the display,
+        // which only needs to see their result a few times per second.
+        isPublished = (numOfSampledPixels == numOfSelectedPixels ||
+                       clock.now() - lastPublication >
+                           std::chrono::milliseconds(50));
+        if (!isPublished)
+          return;
+        auto imagePtr = resolve(statistics, *baseImagePtr);
+        std::lock_guard<std::mutex> lock(m_imageMutex);
+        m_imagePtr = imagePtr;
+        lastPublication = clock.now();
+      });
+  if (!isPublished && !token.isCancelled()) {
+    auto imagePtr = resolve(statistics, *baseImagePtr);
+    std::lock_guard<std::mutex> lock(m_imageMutex);
+    m_imagePtr = imagePtr;
   }
 }
 
+RayTracer::TimedRender
+RayTracer::renderUntil(const std::shared_ptr<Scene> scenePtr,
+                       std::chrono::steady_clock::time_point deadline,
+                       const CancellationToken &token) {
+  cancel();
+  std::chrono::steady_clock::time_point before =
+      std::chrono::steady_clock::now();
+  size_t width = m_imagePtr->width();
+  size_t height = m_imagePtr->height();
+  std::vector<PixelStatistics> statistics = initialStatistics(width, height);
+  std::shared_ptr<const Image> baseImagePtr = image();
+  TimedRender timedRender;
+  timedRender.m_numOfPasses = 0;
+  refine(
+      scenePtr, CameraRayGenerator(*scenePtr->camera(), width, height), width,
+      height, statistics,
+      [&]() {
+        return token.isCancelled() ||
+               std::chrono::steady_clock::now() >= deadline;
+      },
+      [&](size_t numOfPasses, size_t) {
+        timedRender.m_numOfPasses = numOfPasses;
+      });
+  timedRender.m_imagePtr = resolve(statistics, *baseImagePtr);
+  timedRender.m_numOfSamples.resize(statistics.size());
+  size_t numOfSamples = 0;
+  size_t numOfSelectedPixels = 0;
+  for (size_t i = 0; i < statistics.size(); i++) {
+    timedRender.m_numOfSamples[i] = statistics[i].m_numOfSamples;
+    numOfSamples += statistics[i].m_numOfSamples;
+    if (statistics[i].m_selected)
+      numOfSelectedPixels++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_imageMutex);
+    m_imagePtr = timedRender.m_imagePtr;
+  }
+  std::chrono::steady_clock::time_point after =
+      std::chrono::steady_clock::now();
+  double elapsedTime =
+      (double)std::chrono::duration_cast<std::chrono::microseconds>(after -
+                                                                    before)
+          .count();
+  double budgetTime =
+      (double)std::chrono::duration_cast<std::chrono::microseconds>(deadline -
+                                                                    before)
+          .count();
+  Console::print("Ray tracing executed in " +
+                 std::to_string(elapsedTime * 1e-3) + "ms for a budget of " +
+                 std::to_string(budgetTime * 1e-3) + "ms: " +
+                 std::to_string(timedRender.m_numOfPasses) +
+                 " complete passes, " +
+                 std::to_string(double(numOfSamples) /
+                                double(std::max<size_t>(1, numOfSelectedPixels))) +
+                 " samples per pixel on average");
+  return timedRender;
+}
+
 bool RayTracer::rayTrace2(const Ray &ray, const std::shared_ptr<Scene> scene,
                           size_t originMeshIndex, size_t originTriangleIndex,
-                          Hit &hit, bool anyHit) {
-  float closest = std::numeric_limits<float>::max();
+                          Hit &hit, bool anyHit, float tMax) {
+  if (!anyHit && m_useBVH && m_twoLevelBVHPtr)
+    return m_twoLevelBVHPtr->intersect(ray, hit, tMax);
+  if (!anyHit && m_useBVH && m_wideBVHPtr)
+    return m_wideBVHPtr->intersect(ray, hit, tMax);
+  if (!anyHit && m_useBVH && m_bvhPtr)
+    return m_bvhPtr->intersect(ray, hit, tMax);
+  float closest = tMax;
   bool intersectionFound = false;
-  std::vector<std::pair<size_t, size_t>> candidateMeshTrianglePairs;
   for (size_t mIndex = 0; mIndex < scene->numOfMeshes(); mIndex++) {
-    const auto &T = scene->mesh(mIndex)->triangleIndices();
-    for (size_t tIndex = 0; tIndex < T.size(); tIndex++)
-      candidateMeshTrianglePairs.push_back(
-          std::pair<size_t, size_t>(mIndex, tIndex));
-  }
-  for (size_t i = 0; i < candidateMeshTrianglePairs.size(); i++) {
-    size_t mIndex = candidateMeshTrianglePairs[i].first;
-    size_t tIndex = candidateMeshTrianglePairs[i].second;
-    if (anyHit && mIndex == originMeshIndex && tIndex == originTriangleIndex)
-      continue;
-    const auto &mesh = scene->mesh(mIndex);
-    const auto &triangleIndices = mesh->triangleIndices();
-    const glm::uvec3 &triangle = triangleIndices[tIndex];
-    const auto &P = mesh->vertexPositions();
-    glm::mat4 modelMatrix = mesh->computeTransformMatrix();
-    float ut, vt, dt;
-    if (ray.triangleIntersect(
-            glm::vec3(modelMatrix * glm::vec4(P[triangle[0]], 1.0)),
-            glm::vec3(modelMatrix * glm::vec4(P[triangle[1]], 1.0)),
-            glm::vec3(modelMatrix * glm::vec4(P[triangle[2]], 1.0)), ut, vt,
-            dt) == true) {
-      if (dt > 0.f) {
-        if (anyHit)
-          return true;
-        else if (dt < closest) {
+    const auto &triangleIndices = scene->mesh(mIndex)->triangleIndices();
+    // Without world-space geometry, the ray is brought into the object space
+    // of each instance instead.
+    bool objectSpace = (m_twoLevelBVHPtr != nullptr);
+    const auto &P = (objectSpace ? scene->mesh(mIndex)->vertexPositions()
+                                 : scene->worldVertexPositions(mIndex));
+    const Ray r = (objectSpace
+                       ? TwoLevelBVH::objectRay(
+                             glm::inverse(scene->modelMatrix(mIndex)), ray)
+                       : ray);
+    for (size_t tIndex = 0; tIndex < triangleIndices.size(); tIndex++) {
+      if (anyHit && mIndex == originMeshIndex && tIndex == originTriangleIndex)
+        continue;
+      const glm::uvec3 &triangle = triangleIndices[tIndex];
+      float ut, vt, dt;
+      if (r.triangleIntersect(P[triangle[0]], P[triangle[1]], P[triangle[2]],
+                                ut, vt, dt) == true) {
+        if (dt > 0.f && dt < closest) {
+          if (anyHit)
+            return true;
           intersectionFound = true;
           closest = dt;
           hit.m_meshIndex = mIndex;
@@ -83,9 +770,21 @@ bool RayTracer::rayTrace2(const Ray &ray, const std::shared_ptr<Scene> scene,
   return intersectionFound;
 }
 
-glm::vec3 RayTracer::lightRadiance(const std::shared_ptr<LightSource> lightPtr,
-                                   const glm::vec3 &position) const {
-  return lightPtr->color() * lightPtr->intensity() * glm::pi<float>();
+glm::vec3
+RayTracer::lightRadiance(const std::shared_ptr<DirectionalLightSource> lightPtr,
+                         const glm::vec3 & /*position*/) const {
+  return lightPtr->color * lightPtr->intensity * glm::pi<float>();
+}
+
+glm::vec3
+RayTracer::lightRadiance(const std::shared_ptr<PointLightSource> lightPtr,
+                         const glm::vec3 &position) const {
+  float d = distance(lightPosition(lightPtr), position);
+  float attenuation = 1.f / (lightPtr->constantAttenuation +
+                             lightPtr->linearAttenuation * d +
+                             lightPtr->quadraticAttenuation * d * d);
+  return lightPtr->color * lightPtr->intensity * glm::pi<float>() *
+         attenuation;
 }
 
 glm::vec3
@@ -93,54 +792,375 @@ RayTracer::materialReflectance(const std::shared_ptr<Scene> scenePtr,
                                const std::shared_ptr<Material> materialPtr,
                                const glm::vec3 &wi, const glm::vec3 &wo,
                                const glm::vec3 &n) const {
-  return BRDF(wi, wo, n, materialPtr->albedo(), materialPtr->roughness(),
-              materialPtr->metallicness());
+  return BRDF(wi, wo, n, materialPtr->albedo, materialPtr->roughness,
+              materialPtr->metallicness);
 }
 
-glm::vec3 RayTracer::shade(const std::shared_ptr<Scene> scenePtr,
-                           const Ray &ray, const Hit &hit) {
-  const auto &mesh = scenePtr->mesh(hit.m_meshIndex);
-  const std::shared_ptr<Material> materialPtr =
-      scenePtr->material(scenePtr->mesh2material(hit.m_meshIndex));
-  const auto &P = mesh->vertexPositions();
-  const auto &N = mesh->vertexNormals();
-  glm::mat4 modelMatrix = mesh->computeTransformMatrix();
-  const glm::uvec3 &triangle = mesh->triangleIndices()[hit.m_triangleIndex];
+void RayTracer::surfacePoint(const std::shared_ptr<Scene> scenePtr,
+                             const Hit &hit, glm::vec3 &position,
+                             glm::vec3 &normal) const {
+  const auto &meshPtr = scenePtr->mesh(hit.m_meshIndex);
+  const glm::uvec3 &triangle = meshPtr->triangleIndices()[hit.m_triangleIndex];
   float w = 1.f - hit.m_uCoord - hit.m_vCoord;
-  glm::vec3 hitPosition =
-      barycentricInterpolation(P[triangle[0]], P[triangle[1]], P[triangle[2]],
-                               w, hit.m_uCoord, hit.m_vCoord);
-  hitPosition = glm::vec3(modelMatrix * glm::vec4(hitPosition, 1.0));
-  glm::vec3 unormalizedHitNormal =
-      barycentricInterpolation(N[triangle[0]], N[triangle[1]], N[triangle[2]],
-                               w, hit.m_uCoord, hit.m_vCoord);
-  glm::mat4 normalMatrix = glm::transpose(glm::inverse(modelMatrix));
-  glm::vec3 hitNormal = normalize(glm::vec3(
-      normalMatrix * glm::vec4(normalize(unormalizedHitNormal), 1.0)));
-  glm::vec3 wo = normalize(-ray.direction());
+  // Positions and normals are cached in world space by the scene, so that a
+  // hit is two interpolations. Instances instead share the object-space
+  // geometry of their mesh: the hit is interpolated there, then placed by the
+  // matrices of the instance.
+  bool objectSpace = (m_twoLevelBVHPtr != nullptr);
+  const auto &P = (objectSpace ? meshPtr->vertexPositions()
+                               : scenePtr->worldVertexPositions(hit.m_meshIndex));
+  const auto &N = (objectSpace ? meshPtr->vertexNormals()
+                               : scenePtr->worldVertexNormals(hit.m_meshIndex));
+  position = barycentricInterpolation(P[triangle[0]], P[triangle[1]],
+                                      P[triangle[2]], w, hit.m_uCoord,
+                                      hit.m_vCoord);
+  glm::vec3 n = barycentricInterpolation(N[triangle[0]], N[triangle[1]],
+                                         N[triangle[2]], w, hit.m_uCoord,
+                                         hit.m_vCoord);
+  // The vertices of degenerate triangles get NaN normals, and opposite normals
+  // may cancel out: the normal of the hit triangle, which is never degenerate,
+  // is used instead.
+  if (!(dot(n, n) > 0.f))
+    n = cross(P[triangle[1]] - P[triangle[0]], P[triangle[2]] - P[triangle[0]]);
+  if (objectSpace) {
+    position = glm::vec3(scenePtr->modelMatrix(hit.m_meshIndex) *
+                         glm::vec4(position, 1.0));
+    n = scenePtr->normalMatrix(hit.m_meshIndex) * n;
+  }
+  normal = normalize(n);
+}
+
+glm::vec3 RayTracer::directLighting(const std::shared_ptr<Scene> scenePtr,
+                                    const Hit &hit, const glm::vec3 &position,
+                                    const glm::vec3 &normal,
+                                    const glm::vec3 &wo) {
+  const std::shared_ptr<Material> materialPtr =
+      scenePtr->mesh(hit.m_meshIndex)->material();
   glm::vec3 colorResponse(0.f, 0.f, 0.f);
-  for (size_t i = 0; i < scenePtr->numOfLightSources(); ++i) {
-    const std::shared_ptr<LightSource> light = scenePtr->lightSource(i);
-    glm::vec3 wi = normalize(-light->direction());
-    float wiDotN = max(0.f, dot(wi, hitNormal));
+  for (const auto &light : scenePtr->lights()) {
+    glm::vec3 wi = normalize(-light->direction);
+    float wiDotN = max(0.f, dot(wi, normal));
     if (wiDotN <= 0.f)
       continue;
-    colorResponse +=
-        lightRadiance(light, hitPosition) *
-        materialReflectance(scenePtr, materialPtr, wi, wo, hitNormal) * wiDotN;
+    if (rayTrace(Ray(position, wi), scenePtr, hit.m_meshIndex,
+                 hit.m_triangleIndex))
+      continue;
+    colorResponse += lightRadiance(light, position) *
+                     materialReflectance(scenePtr, materialPtr, wi, wo, normal) *
+                     wiDotN;
+  }
+  for (const auto &light : scenePtr->pointLights()) {
+    glm::vec3 toLight = lightPosition(light) - position;
+    float lightDistance = length(toLight);
+    glm::vec3 wi = toLight / lightDistance;
+    float wiDotN = max(0.f, dot(wi, normal));
+    if (wiDotN <= 0.f)
+      continue;
+    // The shadow ray stops at the light: occluders behind it are ignored.
+    if (rayTrace(Ray(position, wi), scenePtr, hit.m_meshIndex,
+                 hit.m_triangleIndex, lightDistance))
+      continue;
+    colorResponse += lightRadiance(light, position) *
+                     materialReflectance(scenePtr, materialPtr, wi, wo, normal) *
+                     wiDotN;
   }
   return colorResponse;
 }
 
-// Preparing for Monte Carlo Path Tracing...
+glm::vec3 RayTracer::shade(const std::shared_ptr<Scene> scenePtr,
+                           const Ray &ray, const Hit &hit) {
+  glm::vec3 hitPosition, hitNormal;
+  surfacePoint(scenePtr, hit, hitPosition, hitNormal);
+  return directLighting(scenePtr, hit, hitPosition, hitNormal,
+                        normalize(-ray.direction()));
+}
+
+bool RayTracer::scatter(const std::shared_ptr<Scene> scenePtr,
+                        const std::shared_ptr<Material> materialPtr,
+                        const glm::vec3 &position, const glm::vec3 &normal,
+                        const glm::vec3 &wo, size_t depth,
+                        PixelSample &pixelSample, glm::vec3 &throughput,
+                        Ray &ray) const {
+  // Each vertex has its own dimensions, so that the first bounces of all the
+  // paths of a pixel stay well distributed whatever happened before.
+  pixelSample.setDimension(numOfCameraDimensions +
+                           uint32_t(depth) * numOfDimensionsPerVertex);
+  glm::vec2 u = pixelSample.next2D();
+  float lobe = pixelSample.next1D();
+  float roulette = pixelSample.next1D();
+  glm::vec3 wi;
+  float pdf = sampleBRDF(wo, normal, materialPtr->albedo,
+                         materialPtr->roughness, materialPtr->metallicness,
+                         lobe, u.x, u.y, wi);
+  float wiDotN = dot(wi, normal);
+  if (pdf <= 0.f || wiDotN <= 0.f)
+    return false;
+  throughput *=
+      materialReflectance(scenePtr, materialPtr, wi, wo, normal) * wiDotN /
+      pdf;
+  if (depth + 1 >= m_russianRouletteDepth) {
+    float survival = std::min(
+        0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+    if (roulette >= survival)
+      return false;
+    throughput /= survival;
+  }
+  ray = Ray(position + m_rayEpsilon * normal, wi);
+  return true;
+}
+
+// All the light sources are delta lights, which BRDF sampling never hits: they
+// are only reached by the explicit connection at each vertex, so the two
+// strategies need no multiple importance sampling.
+glm::vec3 RayTracer::tracePath(const std::shared_ptr<Scene> scenePtr,
+                               const Ray &primaryRay,
+                               PixelSample &pixelSample) {
+  glm::vec3 radiance(0.f, 0.f, 0.f);
+  glm::vec3 throughput(1.f, 1.f, 1.f);
+  Ray ray = primaryRay;
+  for (size_t depth = 0; depth < m_maxPathDepth; depth++) {
+    Hit hit;
+    if (!rayTrace2(ray, scenePtr, 0, 0, hit, false) || hit.m_distance <= 0.f) {
+      // The background is a backdrop rather than an environment light.
+      if (depth == 0)
+        radiance += scenePtr->backgroundColor();
+      break;
+    }
+    glm::vec3 position, normal;
+    surfacePoint(scenePtr, hit, position, normal);
+    glm::vec3 wo = normalize(-ray.direction());
+    radiance +=
+        throughput * directLighting(scenePtr, hit, position, normal, wo);
+    if (depth + 1 == m_maxPathDepth || dot(normal, wo) <= 0.f ||
+        !scatter(scenePtr, scenePtr->mesh(hit.m_meshIndex)->material(),
+                 position, normal, wo, depth, pixelSample, throughput, ray))
+      break;
+  }
+  return radiance;
+}
+
 glm::vec3 RayTracer::sample(const std::shared_ptr<Scene> scenePtr,
-                            const Ray &ray, size_t originMeshIndex,
-                            size_t originTriangleIndex) {
+                            const Ray &ray, PixelSample &pixelSample) {
+  if (m_integrator == Integrator::PathTracing)
+    return tracePath(scenePtr, ray, pixelSample);
   Hit hit;
-  bool intersectionFound = rayTrace2(ray, scenePtr, originMeshIndex,
-                                     originTriangleIndex, hit, false);
+  bool intersectionFound = rayTrace2(ray, scenePtr, 0, 0, hit, false);
   if (intersectionFound && hit.m_distance > 0.f) {
     return shade(scenePtr, ray, hit);
   } else
     return scenePtr->backgroundColor();
 }
+
+bool RayTracer::traceWavefront(const std::shared_ptr<Scene> scenePtr,
+                               const Sampler &sampler,
+                               const std::vector<Ray> &rays,
+                               const std::vector<glm::uvec3> &pixelSamples,
+                               std::vector<glm::vec3> &radiance,
+                               const std::function<bool()> &interrupted) {
+  // Meshes sharing a material are shaded together.
+  std::vector<std::shared_ptr<Material>> materials;
+  std::vector<uint64_t> materialIndices(scenePtr->numOfMeshes());
+  for (size_t i = 0; i < scenePtr->numOfMeshes(); i++) {
+    const std::shared_ptr<Material> materialPtr = scenePtr->mesh(i)->material();
+    materialIndices[i] =
+        std::find(materials.begin(), materials.end(), materialPtr) -
+        materials.begin();
+    if (materialIndices[i] == materials.size())
+      materials.push_back(materialPtr);
+  }
+  size_t maxPathDepth =
+      (m_integrator == Integrator::PathTracing ? m_maxPathDepth : 1);
+  radiance.assign(rays.size(), glm::vec3(0.f, 0.f, 0.f));
+  std::vector<WavefrontPath> paths;
+  paths.reserve(rays.size());
+  for (size_t i = 0; i < rays.size(); i++)
+    paths.push_back(WavefrontPath{rays[i], glm::vec3(1.f, 1.f, 1.f),
+                                  pixelSamples[i], uint32_t(i), Hit{},
+                                  glm::vec3(0.f, 0.f, 0.f),
+                                  glm::vec3(0.f, 0.f, 0.f),
+                                  glm::vec3(0.f, 0.f, 0.f)});
+  // Rays per packet, 1 without packets.
+  size_t packetSize = (m_useBVH && m_bvhPtr ? m_rayPacketSize * m_rayPacketSize
+                                            : 1);
+  std::vector<Ray> packetRays;
+  std::vector<uint8_t> found;
+  std::vector<std::pair<uint64_t, uint32_t>> keys;
+  std::vector<WavefrontPath> sortedPaths;
+  std::vector<WavefrontShadowRay> shadowRays;
+  BRDFBatch brdfBatch;
+  std::vector<uint32_t> shadowRayOrder;
+  std::vector<uint8_t> occluded;
+  for (size_t depth = 0; depth < maxPathDepth && !paths.empty(); depth++) {
+    if (interrupted())
+      return false;
+    // Intersection stage. The primary rays, ordered by blocks of pixels, are
+    // traced in packets; the scattered rays of the next stages one by one.
+    found.resize(paths.size());
+    if (depth == 0 && packetSize > 1)
+      for (size_t begin = 0; begin < paths.size(); begin += packetSize) {
+        size_t numOfRays = std::min(packetSize, paths.size() - begin);
+        Hit packetHits[BVH::MAX_PACKET_SIZE];
+        bool packetFound[BVH::MAX_PACKET_SIZE];
+        packetRays.clear();
+        for (size_t i = 0; i < numOfRays; i++)
+          packetRays.push_back(paths[begin + i].m_ray);
+        if (m_wideBVHPtr)
+          m_wideBVHPtr->intersect(packetRays.data(), numOfRays, packetHits,
+                                  packetFound);
+        else
+          m_bvhPtr->intersect(packetRays.data(), numOfRays, packetHits,
+                              packetFound);
+        for (size_t i = 0; i < numOfRays; i++) {
+          found[begin + i] = packetFound[i];
+          paths[begin + i].m_hit = packetHits[i];
+        }
+      }
+    else
+      for (size_t i = 0; i < paths.size(); i++)
+        found[i] = rayTrace2(paths[i].m_ray, scenePtr, 0, 0, paths[i].m_hit,
+                             false);
+    // Missed paths end, the background being a backdrop.
+    keys.clear();
+    for (size_t i = 0; i < paths.size(); i++) {
+      WavefrontPath &path = paths[i];
+      if (!found[i] || path.m_hit.m_distance <= 0.f) {
+        if (depth == 0)
+          radiance[path.m_batchIndex] += scenePtr->backgroundColor();
+        continue;
+      }
+      keys.push_back(std::make_pair(
+          (materialIndices[path.m_hit.m_meshIndex] << 48) |
+              (uint64_t(path.m_hit.m_meshIndex) << 32) |
+              uint64_t(path.m_hit.m_triangleIndex),
+          uint32_t(i)));
+    }
+    // Sorted by material, mesh and triangle: each group of hits shades the
+    // same data, and emits rays from neighboring origins.
+    std::sort(keys.begin(), keys.end());
+    sortedPaths.clear();
+    for (const auto &key : keys)
+      sortedPaths.push_back(paths[key.second]);
+    std::swap(paths, sortedPaths);
+    // Shading stage: one shadow ray per light facing each vertex, in the
+    // order of directLighting so that the sums are the same. The BRDF of all
+    // the shadow rays are then evaluated together in SIMD lanes.
+    shadowRays.clear();
+    brdfBatch.clear();
+    for (size_t i = 0; i < paths.size(); i++) {
+      WavefrontPath &path = paths[i];
+      surfacePoint(scenePtr, path.m_hit, path.m_position, path.m_normal);
+      path.m_direct = glm::vec3(0.f, 0.f, 0.f);
+      const std::shared_ptr<Material> materialPtr =
+          scenePtr->mesh(path.m_hit.m_meshIndex)->material();
+      glm::vec3 wo = normalize(-path.m_ray.direction());
+      uint32_t lightIndex = 0;
+      for (const auto &light : scenePtr->lights()) {
+        lightIndex++;
+        glm::vec3 wi = normalize(-light->direction);
+        float wiDotN = max(0.f, dot(wi, path.m_normal));
+        if (wiDotN <= 0.f)
+          continue;
+        shadowRays.push_back(WavefrontShadowRay{
+            Ray(path.m_position, wi), std::numeric_limits<float>::max(),
+            lightRadiance(light, path.m_position), wiDotN, uint32_t(i),
+            lightIndex - 1});
+        brdfBatch.push(wi, wo, path.m_normal, materialPtr->albedo,
+                       materialPtr->roughness, materialPtr->metallicness);
+      }
+      for (const auto &light : scenePtr->pointLights()) {
+        lightIndex++;
+        glm::vec3 toLight = lightPosition(light) - path.m_position;
+        float lightDistance = length(toLight);
+        glm::vec3 wi = toLight / lightDistance;
+        float wiDotN = max(0.f, dot(wi, path.m_normal));
+        if (wiDotN <= 0.f)
+          continue;
+        shadowRays.push_back(WavefrontShadowRay{
+            Ray(path.m_position, wi), lightDistance,
+            lightRadiance(light, path.m_position), wiDotN, uint32_t(i),
+            lightIndex - 1});
+        brdfBatch.push(wi, wo, path.m_normal, materialPtr->albedo,
+                       materialPtr->roughness, materialPtr->metallicness);
+      }
+    }
+    // Same values as materialReflectance, bit for bit.
+    brdfBatch.evaluate();
+    for (size_t i = 0; i < shadowRays.size(); i++)
+      shadowRays[i].m_radiance =
+          shadowRays[i].m_radiance * brdfBatch.result(i) *
+          shadowRays[i].m_wiDotN;
+    if (interrupted())
+      return false;
+    // Occlusion stage. Shadow rays toward the same light are traced in
+    // packets, in the order of their vertices within each light.
+    occluded.resize(shadowRays.size());
+    if (packetSize > 1) {
+      shadowRayOrder.resize(shadowRays.size());
+      for (size_t i = 0; i < shadowRays.size(); i++)
+        shadowRayOrder[i] = uint32_t(i);
+      std::stable_sort(shadowRayOrder.begin(), shadowRayOrder.end(),
+                       [&](uint32_t a, uint32_t b) {
+                         return shadowRays[a].m_lightIndex <
+                                shadowRays[b].m_lightIndex;
+                       });
+      for (size_t begin = 0; begin < shadowRays.size();) {
+        uint32_t lightIndex = shadowRays[shadowRayOrder[begin]].m_lightIndex;
+        float tMax[BVH::MAX_PACKET_SIZE];
+        size_t excludedMeshIndices[BVH::MAX_PACKET_SIZE];
+        size_t excludedTriangleIndices[BVH::MAX_PACKET_SIZE];
+        bool packetOccluded[BVH::MAX_PACKET_SIZE];
+        packetRays.clear();
+        for (size_t end = begin;
+             end < shadowRays.size() && end - begin < packetSize &&
+             shadowRays[shadowRayOrder[end]].m_lightIndex == lightIndex;
+             end++) {
+          const WavefrontShadowRay &shadowRay = shadowRays[shadowRayOrder[end]];
+          const Hit &hit = paths[shadowRay.m_pathIndex].m_hit;
+          tMax[packetRays.size()] = shadowRay.m_tMax;
+          excludedMeshIndices[packetRays.size()] = hit.m_meshIndex;
+          excludedTriangleIndices[packetRays.size()] = hit.m_triangleIndex;
+          packetRays.push_back(shadowRay.m_ray);
+        }
+        if (m_wideBVHPtr)
+          m_wideBVHPtr->occluded(packetRays.data(), packetRays.size(), tMax,
+                                 excludedMeshIndices, excludedTriangleIndices,
+                                 packetOccluded);
+        else
+          m_bvhPtr->occluded(packetRays.data(), packetRays.size(), tMax,
+                             excludedMeshIndices, excludedTriangleIndices,
+                             packetOccluded);
+        for (size_t i = 0; i < packetRays.size(); i++)
+          occluded[shadowRayOrder[begin + i]] = packetOccluded[i];
+        begin += packetRays.size();
+      }
+    } else
+      for (size_t i = 0; i < shadowRays.size(); i++) {
+        const Hit &hit = paths[shadowRays[i].m_pathIndex].m_hit;
+        occluded[i] = rayTrace(shadowRays[i].m_ray, scenePtr, hit.m_meshIndex,
+                               hit.m_triangleIndex, shadowRays[i].m_tMax);
+      }
+    for (size_t i = 0; i < shadowRays.size(); i++)
+      if (!occluded[i])
+        paths[shadowRays[i].m_pathIndex].m_direct += shadowRays[i].m_radiance;
+    // Extension stage: the surviving paths are compacted with their next ray.
+    size_t numOfPaths = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+      WavefrontPath &path = paths[i];
+      radiance[path.m_batchIndex] += path.m_throughput * path.m_direct;
+      glm::vec3 wo = normalize(-path.m_ray.direction());
+      if (depth + 1 == maxPathDepth || dot(path.m_normal, wo) <= 0.f)
+        continue;
+      PixelSample pixelSample(sampler, path.m_pixelSample.x,
+                              path.m_pixelSample.y, path.m_pixelSample.z);
+      if (!scatter(scenePtr, scenePtr->mesh(path.m_hit.m_meshIndex)->material(),
+                   path.m_position, path.m_normal, wo, depth, pixelSample,
+                   path.m_throughput, path.m_ray))
+        continue;
+      if (numOfPaths != i)
+        paths[numOfPaths] = path;
+      numOfPaths++;
+    }
+    paths.erase(paths.begin() + numOfPaths, paths.end());
+  }
+  return true;
+}
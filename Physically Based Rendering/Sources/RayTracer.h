@@ -9,31 +9,275 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <functional>
 #include <limits>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <glm/ext.hpp>
 #include <glm/glm.hpp>
 
+#include "BVH.h"
+#include "Camera.h"
+#include "CancellationToken.h"
 #include "Image.h"
+#include "Sampler.h"
+#include "Ray.h"
 #include "Renderer.h"
 #include "Scene.h"
+#include "TileScheduler.h"
+#include "TwoLevelBVH.h"
+#include "WideBVH.h"
 
 using namespace std;
 
 class RayTracer : public Renderer {
 public:
+  /// Light transport algorithm estimating the radiance of each pixel sample.
+  enum class Integrator {
+    DirectLighting, ///< Light sources seen from the first hit only.
+    PathTracing     ///< Random walk sampling the BRDF, with the light sources
+                    ///< sampled explicitly at each vertex.
+  };
+
+  /// Pixels [m_x0, m_x1[ x [m_y0, m_y1[ of the image, top row first.
+  using CropWindow = TileScheduler::Tile;
+
+  /// Outcome of a time-budgeted rendering.
+  struct TimedRender {
+    std::shared_ptr<Image> m_imagePtr;
+    /// Samples averaged in each pixel, row by row. Pixels left at 0 samples,
+    /// outside the crop window and mask or too late for the deadline, keep
+    /// their previous value.
+    std::vector<uint32_t> m_numOfSamples;
+    size_t m_numOfPasses; ///< Passes completed over all the active pixels.
+  };
+
   RayTracer();
   virtual ~RayTracer();
 
+  /// Cancels the background rendering, if any.
   inline void setResolution(int width, int height) {
+    cancel();
+    std::lock_guard<std::mutex> lock(m_imageMutex);
     m_imagePtr = make_shared<Image>(width, height);
   }
-  inline std::shared_ptr<Image> image() { return m_imagePtr; }
-  inline const std::shared_ptr<Image> image() const { return m_imagePtr; }
+  /// The last rendered image. During progressive rendering, the running
+  /// average of the passes completed so far. A background frame only replaces
+  /// it once complete.
+  inline std::shared_ptr<Image> image() {
+    std::lock_guard<std::mutex> lock(m_imageMutex);
+    return m_imagePtr;
+  }
+  inline const std::shared_ptr<Image> image() const {
+    std::lock_guard<std::mutex> lock(m_imageMutex);
+    return m_imagePtr;
+  }
+
+  /// Pool of threads rendering the image tile by tile.
+  inline std::shared_ptr<TileScheduler> tileScheduler() {
+    return m_tileSchedulerPtr;
+  }
+  /// Replaces the pool, e.g. to render on a given number of threads. Cancels
+  /// the background rendering.
+  inline void setTileScheduler(std::shared_ptr<TileScheduler> tileSchedulerPtr) {
+    cancel();
+    m_tileSchedulerPtr = tileSchedulerPtr;
+  }
+  /// Builds the acceleration structure of the scene. Must be called again
+  /// whenever the scene geometry changes. Cancels the background rendering.
   void init(const std::shared_ptr<Scene> scenePtr);
+  /// Renders the whole image before returning. Cancels the background
+  /// rendering.
   virtual void render(const std::shared_ptr<Scene> scenePtr) final;
+  /// Renders the whole image unless the token is cancelled first, in which
+  /// case the workers give up within one row of a tile, image() is left
+  /// untouched and false is returned. Cancels the background rendering.
+  bool render(const std::shared_ptr<Scene> scenePtr,
+              const CancellationToken &token);
+  /// Refines the image progressively until the deadline, or until adaptive
+  /// sampling, if enabled, converges, and returns the image reached, which
+  /// also becomes image(). The workers stop within one row of a tile of the
+  /// deadline or of a cancellation of the token; the last pass may be
+  /// partial, leaving pixels with one sample less than others. Cancels the
+  /// background rendering.
+  TimedRender renderUntil(const std::shared_ptr<Scene> scenePtr,
+                          std::chrono::steady_clock::time_point deadline,
+                          const CancellationToken &token = CancellationToken());
+
+  /// Starts, or restarts, rendering the image on a background thread. The
+  /// camera is captured at this call; the rest of the scene must not be
+  /// edited until cancel.
+  void startRender(const std::shared_ptr<Scene> scenePtr);
+  /// Starts, or restarts, rendering on a background thread one sample per
+  /// pixel per pass, jittered within the pixel, and publishing the running
+  /// average to image() after each pass. The camera is captured at this call;
+  /// the rest of the scene must not be edited until cancel.
+  void startProgressive(const std::shared_ptr<Scene> scenePtr);
+  /// Cancels the background rendering, if any, and waits for its workers,
+  /// which give up within one row of a tile.
+  void cancel();
+  inline bool isProgressive() const { return m_isProgressive; }
+  /// Number of passes completed by the progressive rendering, which is the
+  /// number of samples per pixel averaged in image() unless adaptive sampling
+  /// left some pixels behind.
+  inline size_t numOfProgressiveSamples() const {
+    return m_numOfProgressiveSamples;
+  }
+
+  /// Adaptive progressive rendering: after a few passes, only the pixels
+  /// whose estimated noise is above the threshold, or next to such a pixel,
+  /// keep being sampled. The rendering stops once all pixels have converged
+  /// or the sample budget is spent. Applies from the next startProgressive.
+  inline void setAdaptiveSampling(bool adaptive) {
+    m_adaptiveSampling = adaptive;
+  }
+  inline bool adaptiveSampling() const { return m_adaptiveSampling; }
+
+  /// Relative standard error of the mean luminance below which a pixel has
+  /// converged.
+  inline void setNoiseThreshold(float threshold) {
+    m_noiseThreshold = threshold;
+  }
+  inline float noiseThreshold() const { return m_noiseThreshold; }
+
+  /// Total number of samples of an adaptive rendering, in samples per pixel
+  /// on average.
+  inline void setSampleBudget(size_t samplesPerPixel) {
+    m_sampleBudget = samplesPerPixel;
+  }
+  inline size_t sampleBudget() const { return m_sampleBudget; }
+
+  /// Restricts the next renderings to the pixels of the window, clipped to
+  /// the image, so that their cost is proportional to its area. The other
+  /// pixels of image() are left untouched. Cancels the background rendering.
+  inline void setCropWindow(const CropWindow &window) {
+    cancel();
+    m_cropWindow = window;
+    m_hasCropWindow = true;
+  }
+  /// Renders the whole image again. Cancels the background rendering.
+  inline void clearCropWindow() {
+    cancel();
+    m_hasCropWindow = false;
+  }
+  inline bool hasCropWindow() const { return m_hasCropWindow; }
+  inline const CropWindow &cropWindow() const { return m_cropWindow; }
+
+  /// Further restricts the next renderings to the pixels with a non-zero mask
+  /// value, given for each pixel row by row. The mask is ignored while its
+  /// size differs from the image's. Cancels the background rendering.
+  inline void setPixelMask(const std::vector<uint8_t> &mask) {
+    cancel();
+    m_pixelMask = mask;
+  }
+  /// Cancels the background rendering.
+  inline void clearPixelMask() {
+    cancel();
+    m_pixelMask.clear();
+  }
+  inline const std::vector<uint8_t> &pixelMask() const { return m_pixelMask; }
+
+  /// Toggles the BVH traversal. When disabled, every ray is tested against
+  /// every triangle of the scene (useful to measure the acceleration).
+  inline void setUseBVH(bool useBVH) { m_useBVH = useBVH; }
+  inline bool useBVH() const { return m_useBVH; }
+
+  /// Split strategy used by the next call to init.
+  inline void setBVHSplitMethod(BVH::SplitMethod splitMethod) {
+    m_bvhSplitMethod = splitMethod;
+  }
+  inline BVH::SplitMethod bvhSplitMethod() const { return m_bvhSplitMethod; }
+
+  /// Width of the BVH nodes traversed by the next call to init: 2 for the
+  /// binary BVH, 4 or 8 for a collapsed wide BVH.
+  inline void setBVHWidth(size_t width) { m_bvhWidth = width; }
+  inline size_t bvhWidth() const { return m_bvhWidth; }
+
+  /// Whether the next call to init builds a two-level BVH, with one
+  /// object-space BVH per distinct mesh (of the width above) shared by its
+  /// instances, instead of a single BVH over the world-space triangles. Ray
+  /// packets and the traversal benchmark need the single-level BVH.
+  inline void setTwoLevelBVH(bool twoLevelBVH) {
+    m_useTwoLevelBVH = twoLevelBVH;
+  }
+  inline bool twoLevelBVH() const { return m_useTwoLevelBVH; }
+
+  /// Takes new transforms of the mesh instances into account: with the
+  /// two-level BVH, only updates the matrices cached by the scene and rebuilds
+  /// the top level, the geometry staying in object space; otherwise calls
+  /// init. Cancels the background rendering.
+  void updateTransforms(const std::shared_ptr<Scene> scenePtr);
+
+  inline void setIntegrator(Integrator integrator) { m_integrator = integrator; }
+  inline Integrator integrator() const { return m_integrator; }
+
+  /// Maximum number of path vertices, 1 giving direct lighting only.
+  inline void setMaxPathDepth(size_t depth) {
+    m_maxPathDepth = std::max<size_t>(1, depth);
+  }
+  inline size_t maxPathDepth() const { return m_maxPathDepth; }
+
+  /// Number of path vertices after which paths are randomly terminated with a
+  /// probability growing as their throughput decreases (Russian roulette).
+  inline void setRussianRouletteDepth(size_t depth) {
+    m_russianRouletteDepth = depth;
+  }
+  inline size_t russianRouletteDepth() const { return m_russianRouletteDepth; }
+
+  /// Key of the random streams: renders with the same seed are bit-identical
+  /// whatever the number of threads and the tile order, and renders with
+  /// different seeds are independent.
+  inline void setSeed(uint32_t seed) { m_seed = seed; }
+  inline uint32_t seed() const { return m_seed; }
+
+  /// Sample generator of the pixel jitter and path decisions. The stratified
+  /// sampler is sized after the sample budget.
+  inline void setSamplerType(Sampler::Type type) { m_samplerType = type; }
+  inline Sampler::Type samplerType() const { return m_samplerType; }
+
+  /// Wavefront rendering: the samples of each tile are traced as one batch,
+  /// a path vertex at a time. All the rays of the batch are intersected, the
+  /// hits are sorted by material and mesh, shaded group by group, the shadow
+  /// rays of the batch are traced together and the next rays are emitted.
+  /// Images are identical to the per-pixel ones. Cancellations and deadlines
+  /// are checked between stages rather than between rows, and an interrupted
+  /// batch is dropped as a whole. Applies from the next rendering.
+  inline void setWavefront(bool wavefront) { m_wavefront = wavefront; }
+  inline bool wavefront() const { return m_wavefront; }
+
+  /// Side of the blocks of pixels whose primary rays the wavefront rendering
+  /// traces as packets through the BVH (the wide one when built), 4 or 8, the
+  /// shadow rays toward each light of a batch being traced in packets of the
+  /// same number of rays. 1, the default, traces all the rays one by one,
+  /// which the SIMD traversal of the wide BVH usually makes faster on scenes
+  /// covering a small part of the image. Applies from the next rendering.
+  inline void setRayPacketSize(size_t size) {
+    m_rayPacketSize = std::min<size_t>(
+        std::max<size_t>(1, size),
+        size_t(std::sqrt(float(BVH::MAX_PACKET_SIZE))));
+  }
+  inline size_t rayPacketSize() const { return m_rayPacketSize; }
+
+  /// Builds the BVH of the scene with 1, 2, 4... up to the maximum number of
+  /// threads and prints the build time of each run. Cancels the background
+  /// rendering.
+  void benchmarkBVHBuild(const std::shared_ptr<Scene> scenePtr);
+
+  /// Traces the primary rays of the current image through the binary, 4-wide
+  /// and, when AVX is available, 8-wide BVH, then in 4x4 and 8x8 packets
+  /// through the binary BVH and the wide one, and prints the rays/sec of each.
+  /// Requires init. Cancels the background rendering.
+  void benchmarkBVHTraversal(const std::shared_ptr<Scene> scenePtr);
+
+  /// Renders a few passes of the current image with the current integrator,
+  /// per pixel then in wavefront, and prints the samples/sec of each. Requires
+  /// init. Cancels the background rendering.
+  void benchmarkWavefront(const std::shared_ptr<Scene> scenePtr);
 
 private:
   template <typename T>
@@ -42,33 +286,177 @@ private:
     return w * p0 + u * p1 + v * p2;
   }
 
-  struct Hit {
-    size_t m_meshIndex;
-    size_t m_triangleIndex;
-    float m_uCoord;
-    float m_vCoord;
-    float m_distance;
-  };
-
   bool rayTrace2(const Ray &ray, const std::shared_ptr<Scene> scene,
                  size_t originMeshIndex, size_t originTriangleIndex, Hit &hit,
-                 bool anyHit);
+                 bool anyHit,
+                 float tMax = std::numeric_limits<float>::max());
+  /// Occlusion query: true if anything but the origin triangle lies along the
+  /// ray at a distance in ]0, tMax[.
   inline bool rayTrace(const Ray &ray, const std::shared_ptr<Scene> scene,
-                       size_t originMeshIndex, size_t originTriangleIndex) {
+                       size_t originMeshIndex, size_t originTriangleIndex,
+                       float tMax = std::numeric_limits<float>::max()) {
+    if (m_useBVH && m_twoLevelBVHPtr)
+      return m_twoLevelBVHPtr->occluded(ray, tMax, originMeshIndex,
+                                        originTriangleIndex);
+    if (m_useBVH && m_wideBVHPtr)
+      return m_wideBVHPtr->occluded(ray, tMax, originMeshIndex,
+                                    originTriangleIndex);
+    if (m_useBVH && m_bvhPtr)
+      return m_bvhPtr->occluded(ray, tMax, originMeshIndex,
+                                originTriangleIndex);
     Hit hit;
     return rayTrace2(ray, scene, originMeshIndex, originTriangleIndex, hit,
-                     true);
+                     true, tMax);
+  }
+  inline glm::vec3
+  lightPosition(const std::shared_ptr<PointLightSource> lightPtr) const {
+    return glm::vec3(lightPtr->computeTransformMatrix() *
+                     glm::vec4(lightPtr->position, 1.0));
   }
-  glm::vec3 lightRadiance(const std::shared_ptr<LightSource> lightPtr,
+  glm::vec3 lightRadiance(const std::shared_ptr<DirectionalLightSource> lightPtr,
+                          const glm::vec3 &position) const;
+  glm::vec3 lightRadiance(const std::shared_ptr<PointLightSource> lightPtr,
                           const glm::vec3 &position) const;
   glm::vec3 materialReflectance(const std::shared_ptr<Scene> scenePtr,
                                 const std::shared_ptr<Material> material,
                                 const glm::vec3 &wi, const glm::vec3 &wo,
                                 const glm::vec3 &n) const;
+  /// World-space position and shading normal of a hit.
+  void surfacePoint(const std::shared_ptr<Scene> scenePtr, const Hit &hit,
+                    glm::vec3 &position, glm::vec3 &normal) const;
+  /// Radiance reflected towards wo by the surface point of hit from all the
+  /// light sources, occlusion included.
+  glm::vec3 directLighting(const std::shared_ptr<Scene> scenePtr,
+                           const Hit &hit, const glm::vec3 &position,
+                           const glm::vec3 &normal, const glm::vec3 &wo);
   glm::vec3 shade(const std::shared_ptr<Scene> scenePtr, const Ray &ray,
                   const Hit &hit);
+  /// Samples the BRDF at a path vertex, with the dimensions of the vertex in
+  /// the pixel sample, and applies the Russian roulette. Returns false if the
+  /// path ends, and otherwise updates its throughput and next ray.
+  bool scatter(const std::shared_ptr<Scene> scenePtr,
+               const std::shared_ptr<Material> materialPtr,
+               const glm::vec3 &position, const glm::vec3 &normal,
+               const glm::vec3 &wo, size_t depth, PixelSample &pixelSample,
+               glm::vec3 &throughput, Ray &ray) const;
+  glm::vec3 tracePath(const std::shared_ptr<Scene> scenePtr, const Ray &ray,
+                      PixelSample &pixelSample);
+
+  /// Path of a wavefront batch.
+  struct WavefrontPath {
+    Ray m_ray;
+    glm::vec3 m_throughput;
+    glm::uvec3 m_pixelSample; ///< Pixel x, y and sample index.
+    uint32_t m_batchIndex;    ///< Index of its primary ray in the batch.
+    Hit m_hit;
+    glm::vec3 m_position; ///< Vertex being shaded.
+    glm::vec3 m_normal;
+    glm::vec3 m_direct; ///< Light reaching the vertex through the shadow rays.
+  };
+
+  /// Shadow ray of a wavefront batch, with the radiance it brings to its path
+  /// vertex if unoccluded.
+  struct WavefrontShadowRay {
+    Ray m_ray;
+    float m_tMax;
+    glm::vec3 m_radiance; ///< Of the light, then times the BRDF and cosine.
+    float m_wiDotN;
+    uint32_t m_pathIndex;
+    uint32_t m_lightIndex; ///< Directional lights first, then point lights.
+  };
+
+  /// Radiance estimates of the selected integrator along a batch of primary
+  /// rays, given with their (x, y, sample index) pixel samples, computed stage
+  /// by stage over the batch. Returns false, leaving the estimates partial, if
+  /// interrupted between two stages.
+  bool traceWavefront(const std::shared_ptr<Scene> scenePtr,
+                      const Sampler &sampler, const std::vector<Ray> &rays,
+                      const std::vector<glm::uvec3> &pixelSamples,
+                      std::vector<glm::vec3> &radiance,
+                      const std::function<bool()> &interrupted);
+  /// The crop window clipped to the image, or the whole image without one.
+  CropWindow renderRegion(size_t width, size_t height) const;
+  /// Renders one sample per pixel of the region into a copy of image(),
+  /// published only if the token was not cancelled meanwhile.
+  bool renderFrame(const std::shared_ptr<Scene> scenePtr,
+                   const CameraRayGenerator rayGenerator, size_t width,
+                   size_t height, const CancellationToken token);
+  /// Radiance estimate of the selected integrator along a primary ray, drawing
+  /// its decisions from the dimensions of the pixel sample past the camera.
   glm::vec3 sample(const std::shared_ptr<Scene> scenePtr, const Ray &ray,
-                   size_t originMeshIndex, size_t originTriangleIndex);
+                   PixelSample &pixelSample);
+
+  /// Running statistics of a pixel over the progressive passes.
+  struct PixelStatistics {
+    glm::vec3 m_sum;
+    float m_luminanceMean; ///< Welford running mean of the luminance.
+    float m_luminanceM2;   ///< Sum of squared deviations from the mean.
+    uint32_t m_numOfSamples;
+    bool m_selected; ///< Whether the crop window and mask select the pixel.
+    bool m_active;   ///< Whether the pixel is sampled by the next pass.
+  };
+
+  /// Empty statistics, with the pixels selected by the crop window and mask
+  /// active.
+  std::vector<PixelStatistics> initialStatistics(size_t width,
+                                                 size_t height) const;
+
+  /// Adds one jittered sample to each active pixel. Returns false if the pass
+  /// was interrupted, leaving some pixels behind.
+  bool samplePass(const std::shared_ptr<Scene> scenePtr,
+                  const CameraRayGenerator &rayGenerator,
+                  const Sampler &sampler, size_t width,
+                  size_t height, std::vector<PixelStatistics> &statistics,
+                  const std::function<bool()> &interrupted);
+  /// Deactivates the pixels whose neighborhood has converged below the
+  /// threshold and returns the number of pixels still active.
+  /// Pixels reaching maxNumOfSamples are deactivated as well.
+  size_t updateActivePixels(size_t width, size_t height, float noiseThreshold,
+                            size_t maxNumOfSamples,
+                            std::vector<PixelStatistics> &statistics) const;
+  /// Samples the pixels pass after pass until interrupted returns true or,
+  /// with adaptive sampling, until all pixels converge or the budget is spent.
+  /// passCompleted receives the number of complete passes and of pixels
+  /// sampled by the last one.
+  void refine(const std::shared_ptr<Scene> scenePtr,
+              const CameraRayGenerator &rayGenerator, size_t width,
+              size_t height, std::vector<PixelStatistics> &statistics,
+              const std::function<bool()> &interrupted,
+              const std::function<void(size_t, size_t)> &passCompleted);
+  /// Average of the samples of each pixel, the pixel of baseImage for pixels
+  /// without any.
+  std::shared_ptr<Image> resolve(const std::vector<PixelStatistics> &statistics,
+                                 const Image &baseImage) const;
+  void progressiveLoop(const std::shared_ptr<Scene> scenePtr,
+                       const CameraRayGenerator rayGenerator, size_t width,
+                       size_t height, const CancellationToken token);
 
   std::shared_ptr<Image> m_imagePtr;
+  mutable std::mutex m_imageMutex;
+  std::thread m_backgroundThread;
+  CancellationToken m_backgroundToken;
+  bool m_isProgressive;
+  std::atomic<size_t> m_numOfProgressiveSamples;
+  std::shared_ptr<TileScheduler> m_tileSchedulerPtr;
+  std::shared_ptr<BVH> m_bvhPtr;
+  std::shared_ptr<WideBVH> m_wideBVHPtr;
+  std::shared_ptr<TwoLevelBVH> m_twoLevelBVHPtr;
+  bool m_useBVH;
+  BVH::SplitMethod m_bvhSplitMethod;
+  size_t m_bvhWidth;
+  bool m_useTwoLevelBVH;
+  Integrator m_integrator;
+  size_t m_maxPathDepth;
+  size_t m_russianRouletteDepth;
+  uint32_t m_seed;
+  Sampler::Type m_samplerType;
+  bool m_wavefront;
+  size_t m_rayPacketSize;
+  float m_rayEpsilon; ///< Offset of secondary ray origins, after the scene size.
+  bool m_adaptiveSampling;
+  float m_noiseThreshold;
+  size_t m_sampleBudget;
+  bool m_hasCropWindow;
+  CropWindow m_cropWindow;
+  std::vector<uint8_t> m_pixelMask;
 };
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "Scene.h"
+
+class Renderer {
+public:
+	virtual void render (std::shared_ptr<Scene> scenePtr) = 0;
+};
\ No newline at end of file
@@ -0,0 +1,324 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#include "Sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "RandomStream.h"
+
+using namespace std;
+
+// Maps the 24 most significant bits to [0, 1[.
+static inline float toUnitFloat (uint32_t x) {
+	return float (x >> 8) * (1.f / 16777216.f);
+}
+
+static inline uint32_t reverseBits (uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Hash permuting the bits of x so that each bit only depends on the lower ones [Burley 2020].
+static inline uint32_t laineKarrasPermutation (uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6C50B47Cu;
+	x ^= x * 0xB82F1E52u;
+	x ^= x * 0xC7AFE638u;
+	x ^= x * 0x8D22F6E6u;
+	return x;
+}
+
+// Owen scrambling of a 32 bits fixed point number in [0, 1[.
+static inline uint32_t nestedUniformScramble (uint32_t x, uint32_t seed) {
+	return reverseBits (laineKarrasPermutation (reverseBits (x), seed));
+}
+
+// First two dimensions of the Sobol sequence: van der Corput, then the Pascal matrix.
+static inline uint32_t sobol0 (uint32_t index) {
+	return reverseBits (index);
+}
+
+static inline uint32_t sobol1 (uint32_t index) {
+	uint32_t result = 0;
+	for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+		if (index & 1u)
+			result ^= v;
+	return result;
+}
+
+// Owen-scrambled (0, 2)-sequence point, shuffled and scrambled by three hash values.
+static inline glm::vec2 scrambledSobol2D (uint32_t sampleIndex, const uint32_t hash[3]) {
+	uint32_t index = nestedUniformScramble (sampleIndex, hash[0]);
+	return glm::vec2 (toUnitFloat (nestedUniformScramble (sobol0 (index), hash[1])),
+					  toUnitFloat (nestedUniformScramble (sobol1 (index), hash[2])));
+}
+
+// Random permutation of [0, l[ indexed by p [Kensler 2013].
+static uint32_t permute (uint32_t i, uint32_t l, uint32_t p) {
+	uint32_t w = l - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do {
+		i ^= p;
+		i *= 0xE170893Du;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929EB3Fu;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935FA69u;
+		i ^= (i & w) >> 11;
+		i *= 0x74DCB303u;
+		i ^= (i & w) >> 2;
+		i *= 0x9E501CC3u;
+		i ^= (i & w) >> 2;
+		i *= 0xC860A3DFu;
+		i &= w;
+		i ^= i >> 5;
+	} while (i >= l);
+	return (i + p) % l;
+}
+
+// Random number in [0, 1[ indexed by (i, p) [Kensler 2013].
+static float randomFloat (uint32_t i, uint32_t p) {
+	i ^= p;
+	i ^= i >> 17;
+	i ^= i >> 10;
+	i *= 0xB36534E5u;
+	i ^= i >> 12;
+	i ^= i >> 21;
+	i *= 0x93FC4795u;
+	i ^= 0xDF6E307Fu;
+	i ^= i >> 17;
+	i *= 1 | p >> 18;
+	return toUnitFloat (i);
+}
+
+// Ranks of a 2^n x 2^n tileable blue noise mask, normalized to ]0, 1[, by the void-and-cluster method [Ulichney 1993].
+static std::vector<float> makeBlueNoiseMask (size_t size) {
+	const float sigma = 1.5f;
+	size_t n = size * size;
+	size_t mask = size - 1;
+	std::vector<float> kernel (n);
+	for (size_t y = 0; y < size; y++)
+		for (size_t x = 0; x < size; x++) {
+			float dx = float (std::min (x, size - x));
+			float dy = float (std::min (y, size - y));
+			kernel[y * size + x] = std::exp (-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+		}
+	std::vector<uint8_t> pattern (n, 0);
+	std::vector<float> energy (n, 0.f);
+	auto splat = [&] (size_t i, float sign) {
+		size_t ix = i % size, iy = i / size;
+		for (size_t y = 0; y < size; y++)
+			for (size_t x = 0; x < size; x++)
+				energy[y * size + x] += sign * kernel[((y - iy) & mask) * size + ((x - ix) & mask)];
+	};
+	auto tightestCluster = [&] () {
+		size_t best = n;
+		for (size_t i = 0; i < n; i++)
+			if (pattern[i] && (best == n || energy[i] > energy[best]))
+				best = i;
+		return best;
+	};
+	auto largestVoid = [&] () {
+		size_t best = n;
+		for (size_t i = 0; i < n; i++)
+			if (!pattern[i] && (best == n || energy[i] < energy[best]))
+				best = i;
+		return best;
+	};
+	// Random initial pattern, relaxed by moving its tightest cluster to its largest void until both coincide.
+	size_t numOfInitialPoints = n / 10;
+	RandomStream random (0, 0, 0);
+	for (size_t count = 0; count < numOfInitialPoints;) {
+		size_t i = random.nextUInt () % n;
+		if (!pattern[i]) {
+			pattern[i] = 1;
+			splat (i, 1.f);
+			count++;
+		}
+	}
+	for (;;) {
+		size_t cluster = tightestCluster ();
+		pattern[cluster] = 0;
+		splat (cluster, -1.f);
+		size_t largest = largestVoid ();
+		pattern[largest] = 1;
+		splat (largest, 1.f);
+		if (largest == cluster)
+			break;
+	}
+	std::vector<uint8_t> initialPattern = pattern;
+	std::vector<float> initialEnergy = energy;
+	std::vector<size_t> ranks (n);
+	// The initial points are ranked by removing the tightest cluster first...
+	for (size_t rank = numOfInitialPoints; rank-- > 0;) {
+		size_t cluster = tightestCluster ();
+		pattern[cluster] = 0;
+		splat (cluster, -1.f);
+		ranks[cluster] = rank;
+	}
+	// ... and the others by filling the largest void first. Past half the pixels, the tightest cluster of empty pixels
+	// of the original method is the same pixel, since the energies of the empty and full pixels sum to a constant.
+	pattern = initialPattern;
+	energy = initialEnergy;
+	for (size_t rank = numOfInitialPoints; rank < n; rank++) {
+		size_t largest = largestVoid ();
+		pattern[largest] = 1;
+		splat (largest, 1.f);
+		ranks[largest] = rank;
+	}
+	std::vector<float> values (n);
+	for (size_t i = 0; i < n; i++)
+		values[i] = (float (ranks[i]) + 0.5f) / float (n);
+	return values;
+}
+
+class IndependentSampler : public Sampler {
+public:
+	IndependentSampler (uint32_t seed) : Sampler (seed) {}
+
+	virtual Type type () const { return Type::Independent; }
+
+	virtual float get (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t dimension) const {
+		RandomStream random (x, y, sampleIndex, m_seed);
+		random.setDimension (dimension);
+		return random.next ();
+	}
+
+	virtual glm::vec2 get2D (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t pairDimension) const {
+		RandomStream random (x, y, sampleIndex, m_seed);
+		random.setDimension (pairDimension);
+		float u = random.next ();
+		return glm::vec2 (u, random.next ());
+	}
+};
+
+class StratifiedSampler : public Sampler {
+public:
+	StratifiedSampler (uint32_t samplesPerPixel, uint32_t seed) :
+		Sampler (seed),
+		m_numOfStrata (std::max (1u, uint32_t (std::ceil (std::sqrt (float (samplesPerPixel)))))) {}
+
+	virtual Type type () const { return Type::Stratified; }
+
+	virtual float get (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t dimension) const {
+		return get2D (x, y, sampleIndex, dimension & ~1u)[dimension & 1u];
+	}
+
+	// Each run of m x m samples covers the strata of a new random pattern.
+	virtual glm::vec2 get2D (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t pairDimension) const {
+		uint32_t m = m_numOfStrata;
+		uint32_t hash[4];
+		RandomStream::philox (x, y, pairDimension >> 1, sampleIndex / (m * m), m_seed, hash);
+		uint32_t p = hash[0];
+		uint32_t s = permute (sampleIndex % (m * m), m * m, p * 0x51633E2Du);
+		uint32_t sx = permute (s % m, m, p * 0xA511E9B3u);
+		uint32_t sy = permute (s / m, m, p * 0x63D83595u);
+		float jx = randomFloat (s, p * 0xA399D265u);
+		float jy = randomFloat (s, p * 0x711AD6A5u);
+		glm::vec2 u ((float (s % m) + (float (sy) + jx) / float (m)) / float (m),
+					 (float (s / m) + (float (sx) + jy) / float (m)) / float (m));
+		return glm::min (u, glm::vec2 (1.f - 1.f / 16777216.f));
+	}
+
+private:
+	uint32_t m_numOfStrata; ///< Along each axis.
+};
+
+class SobolSampler : public Sampler {
+public:
+	SobolSampler (uint32_t seed) : Sampler (seed) {}
+
+	virtual Type type () const { return Type::Sobol; }
+
+	virtual float get (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t dimension) const {
+		return get2D (x, y, sampleIndex, dimension & ~1u)[dimension & 1u];
+	}
+
+	// Higher dimensions are padded with independently scrambled (0, 2)-sequences, one per pair of dimensions.
+	virtual glm::vec2 get2D (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t pairDimension) const {
+		uint32_t hash[4];
+		RandomStream::philox (x, y, pairDimension >> 1, 0, m_seed, hash);
+		return scrambledSobol2D (sampleIndex, hash);
+	}
+};
+
+class BlueNoiseSampler : public Sampler {
+public:
+	BlueNoiseSampler (uint32_t seed) : Sampler (seed), m_mask (mask ()) {}
+
+	virtual Type type () const { return Type::BlueNoise; }
+
+	virtual float get (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t dimension) const {
+		return get2D (x, y, sampleIndex, dimension & ~1u)[dimension & 1u];
+	}
+
+	// Cranley-Patterson rotation of the same points in every pixel by the mask, offset differently for each dimension.
+	virtual glm::vec2 get2D (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t pairDimension) const {
+		uint32_t hash[4];
+		RandomStream::philox (0, 0, pairDimension >> 1, 0, m_seed, hash);
+		glm::vec2 u = scrambledSobol2D (sampleIndex, hash);
+		uint32_t offset = hash[3];
+		glm::vec2 shift (m_mask[((y + (offset >> 8)) & (maskSize - 1)) * maskSize + ((x + offset) & (maskSize - 1))],
+						 m_mask[((y + (offset >> 24)) & (maskSize - 1)) * maskSize + ((x + (offset >> 16)) & (maskSize - 1))]);
+		u += shift;
+		return glm::min (u - glm::floor (u), glm::vec2 (1.f - 1.f / 16777216.f));
+	}
+
+private:
+	static const size_t maskSize = 64;
+
+	// Computed once, on first use.
+	static const std::vector<float> & mask () {
+		static const std::vector<float> values = makeBlueNoiseMask (maskSize);
+		return values;
+	}
+
+	const std::vector<float> & m_mask;
+};
+
+std::shared_ptr<Sampler> Sampler::create (Type type, uint32_t samplesPerPixel, uint32_t seed) {
+	switch (type) {
+	case Type::Independent:
+		return std::make_shared<IndependentSampler> (seed);
+	case Type::Stratified:
+		return std::make_shared<StratifiedSampler> (samplesPerPixel, seed);
+	case Type::Sobol:
+		return std::make_shared<SobolSampler> (seed);
+	case Type::BlueNoise:
+	default:
+		return std::make_shared<BlueNoiseSampler> (seed);
+	}
+}
+
+std::string Sampler::name (Type type) {
+	switch (type) {
+	case Type::Independent:
+		return "independent";
+	case Type::Stratified:
+		return "stratified";
+	case Type::Sobol:
+		return "Owen-scrambled Sobol";
+	case Type::BlueNoise:
+	default:
+		return "blue noise";
+	}
+}
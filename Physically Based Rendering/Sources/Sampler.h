@@ -0,0 +1,85 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <glm/glm.hpp>
+
+/// Coordinates in [0, 1[ of the samples of each pixel, over as many dimensions as an estimator consumes.
+/// A coordinate is a pure function of (seed, pixel, sample index, dimension), so a sampler is shared by all the
+/// rendering threads and renders do not depend on their schedule. Dimensions 2k and 2k + 1 are distributed jointly
+/// and meant for 2D decisions such as pixel jitter or direction sampling.
+class Sampler {
+public:
+	enum class Type {
+		Independent, ///< Uncorrelated random numbers.
+		Stratified,  ///< Correlated multi-jittered strata [Kensler 2013], sized after the expected number of samples per pixel.
+		Sobol,       ///< Owen-scrambled Sobol points, shuffled and scrambled independently for each pixel [Burley 2020].
+		BlueNoise    ///< Owen-scrambled Sobol points shared by all pixels, shifted per pixel by a blue noise mask so that the
+		             ///< remaining error looks like blue noise on screen [Heitz and Belcour 2019].
+	};
+
+	/// samplesPerPixel is a hint, only used to size the strata of the stratified sampler.
+	static std::shared_ptr<Sampler> create (Type type, uint32_t samplesPerPixel, uint32_t seed = 0);
+
+	static std::string name (Type type);
+
+	inline Sampler (uint32_t seed) : m_seed (seed) {}
+
+	virtual ~Sampler () {}
+
+	virtual Type type () const = 0;
+
+	virtual float get (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t dimension) const = 0;
+
+	/// Dimensions pairDimension and pairDimension + 1, pairDimension being even.
+	virtual glm::vec2 get2D (uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t pairDimension) const {
+		return glm::vec2 (get (x, y, sampleIndex, pairDimension), get (x, y, sampleIndex, pairDimension + 1));
+	}
+
+protected:
+	uint32_t m_seed;
+};
+
+/// Consecutive dimensions of one sample of a pixel.
+class PixelSample {
+public:
+	inline PixelSample (const Sampler & sampler, uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t dimension = 0) :
+		m_sampler (sampler),
+		m_x (x),
+		m_y (y),
+		m_sampleIndex (sampleIndex),
+		m_dimension (dimension) {}
+
+	/// Next dimension to be drawn.
+	inline uint32_t dimension () const { return m_dimension; }
+
+	/// Skips to a given dimension, so that each decision of an estimator keeps the same dimensions whatever the path.
+	inline void setDimension (uint32_t dimension) { m_dimension = dimension; }
+
+	inline float next1D () { return m_sampler.get (m_x, m_y, m_sampleIndex, m_dimension++); }
+
+	/// Starts at the next even dimension.
+	inline glm::vec2 next2D () {
+		m_dimension += (m_dimension & 1u);
+		glm::vec2 u = m_sampler.get2D (m_x, m_y, m_sampleIndex, m_dimension);
+		m_dimension += 2;
+		return u;
+	}
+
+private:
+	const Sampler & m_sampler;
+	uint32_t m_x;
+	uint32_t m_y;
+	uint32_t m_sampleIndex;
+	uint32_t m_dimension;
+};
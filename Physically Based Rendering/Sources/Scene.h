@@ -49,10 +49,23 @@ public:
 
     inline std::shared_ptr<Camera> camera() { return m_camera; }
 
-    inline void add(std::shared_ptr<Mesh> mesh) { m_meshes.push_back(mesh); }
+    inline void add(std::shared_ptr<Mesh> mesh) { add(mesh, mesh); }
+
+    /// Adds an instance of mesh placed by transform rather than by the transform of the mesh. All the instances of
+    /// a mesh share its geometry, and its bottom level in a two-level BVH. Mesh indices are instance indices.
+    inline void add(std::shared_ptr<Mesh> mesh, std::shared_ptr<Transform> transform)
+    {
+        m_meshes.push_back(mesh);
+        m_transforms.push_back(transform);
+    }
 
     inline size_t numOfMeshes() const { return m_meshes.size(); }
 
+    /// Transform placing a mesh instance: the mesh itself unless given when adding it.
+    inline const std::shared_ptr<Transform> transform(size_t index) const { return m_transforms[index]; }
+
+    inline std::shared_ptr<Transform> transform(size_t index) { return m_transforms[index]; }
+
     inline const std::shared_ptr<Mesh> mesh(size_t index) const { return m_meshes[index]; }
 
     inline std::shared_ptr<Mesh> mesh(size_t index) { return m_meshes[index]; }
@@ -63,16 +76,80 @@ public:
     inline void add(std::shared_ptr<PointLightSource> light) { m_pointLightSources.push_back(light); }
     inline const std::vector<std::shared_ptr<PointLightSource>> &pointLights() const { return m_pointLightSources; }
 
+    /// Recomputes the model and normal matrices of every mesh, which is all geometry kept in object space needs.
+    /// Must be called whenever a transform changes.
+    inline void updateTransformCache()
+    {
+        m_modelMatrices.resize(m_meshes.size());
+        m_normalMatrices.resize(m_meshes.size());
+        for (size_t i = 0; i < m_meshes.size(); i++)
+        {
+            m_modelMatrices[i] = m_transforms[i]->computeTransformMatrix();
+            m_normalMatrices[i] = glm::transpose(glm::inverse(glm::mat3(m_modelMatrices[i])));
+        }
+    }
+
+    /// Recomputes the transform cache, then the world-space vertex positions and normals of every mesh.
+    /// Must be called whenever a mesh or its transform changes, unless the geometry is only used in object space.
+    inline void updateWorldSpaceCache()
+    {
+        updateTransformCache();
+        m_worldVertexPositions.resize(m_meshes.size());
+        m_worldVertexNormals.resize(m_meshes.size());
+        for (size_t i = 0; i < m_meshes.size(); i++)
+        {
+            const auto &P = m_meshes[i]->vertexPositions();
+            auto &worldP = m_worldVertexPositions[i];
+            worldP.resize(P.size());
+            for (size_t j = 0; j < P.size(); j++)
+                worldP[j] = glm::vec3(m_modelMatrices[i] * glm::vec4(P[j], 1.0));
+            const auto &N = m_meshes[i]->vertexNormals();
+            auto &worldN = m_worldVertexNormals[i];
+            worldN.resize(N.size());
+            for (size_t j = 0; j < N.size(); j++)
+                worldN[j] = glm::normalize(m_normalMatrices[i] * N[j]);
+        }
+    }
+
+    /// Frees the world-space vertex positions and normals, when the geometry is only used in object space.
+    inline void clearWorldSpaceGeometry()
+    {
+        m_worldVertexPositions.clear();
+        m_worldVertexNormals.clear();
+    }
+
+    /// Model matrix of a mesh, as of the last call to updateTransformCache.
+    inline const glm::mat4 &modelMatrix(size_t meshIndex) const { return m_modelMatrices[meshIndex]; }
+
+    /// Inverse transpose of the linear part of the model matrix of a mesh, which transforms its normals.
+    inline const glm::mat3 &normalMatrix(size_t meshIndex) const { return m_normalMatrices[meshIndex]; }
+
+    /// World-space vertex positions of a mesh, as of the last call to updateWorldSpaceCache.
+    inline const std::vector<glm::vec3> &worldVertexPositions(size_t meshIndex) const { return m_worldVertexPositions[meshIndex]; }
+
+    /// World-space unit vertex normals of a mesh, as of the last call to updateWorldSpaceCache.
+    inline const std::vector<glm::vec3> &worldVertexNormals(size_t meshIndex) const { return m_worldVertexNormals[meshIndex]; }
+
     inline void clear()
     {
         m_camera.reset();
         m_meshes.clear();
+        m_transforms.clear();
+        m_modelMatrices.clear();
+        m_normalMatrices.clear();
+        m_worldVertexPositions.clear();
+        m_worldVertexNormals.clear();
     }
 
 private:
     glm::vec3 m_backgroundColor;
     std::shared_ptr<Camera> m_camera;
     std::vector<std::shared_ptr<Mesh>> m_meshes;
+    std::vector<std::shared_ptr<Transform>> m_transforms;
+    std::vector<glm::mat4> m_modelMatrices;
+    std::vector<glm::mat3> m_normalMatrices;
+    std::vector<std::vector<glm::vec3>> m_worldVertexPositions;
+    std::vector<std::vector<glm::vec3>> m_worldVertexNormals;
     std::vector<std::shared_ptr<DirectionalLightSource>> m_directionalLightSources;
     std::vector<std::shared_ptr<PointLightSource>> m_pointLightSources;
 };
\ No newline at end of file
@@ -0,0 +1,178 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#define _USE_MATH_DEFINES
+
+#include "TileScheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+using namespace std;
+
+// Interleaves the bits of x and y.
+static uint64_t mortonCode (uint32_t x, uint32_t y) {
+	uint64_t code = 0;
+	for (int i = 0; i < 32; i++)
+		code |= (uint64_t ((x >> i) & 1u) << (2 * i)) | (uint64_t ((y >> i) & 1u) << (2 * i + 1));
+	return code;
+}
+
+TileScheduler::TileScheduler (size_t numOfThreads, size_t tileSize, Order order) :
+	m_tileSize (std::max<size_t> (1, tileSize)),
+	m_order (order),
+	m_renderTile (nullptr),
+	m_generation (0),
+	m_numOfBusyThreads (0),
+	m_quit (false) {
+	numOfThreads = std::max<size_t> (1, numOfThreads);
+	for (size_t i = 0; i < numOfThreads; i++)
+		m_queues.push_back (std::make_unique<Queue> ());
+	for (size_t i = 1; i < numOfThreads; i++)
+		m_threads.push_back (std::thread (&TileScheduler::workerLoop, this, i));
+}
+
+TileScheduler::~TileScheduler () {
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		m_quit = true;
+	}
+	m_startCondition.notify_all ();
+	for (auto & thread : m_threads)
+		thread.join ();
+}
+
+void TileScheduler::run (size_t width, size_t height, const std::function<void (const Tile &)> & renderTile) {
+	run (Tile { 0, 0, width, height }, renderTile);
+}
+
+void TileScheduler::run (const Tile & region, const std::function<void (const Tile &)> & renderTile) {
+	std::vector<Tile> tiles = makeTiles (region);
+	// Each thread starts with a contiguous run of the ordered tiles.
+	size_t numOfQueues = m_queues.size ();
+	for (size_t i = 0; i < numOfQueues; i++) {
+		std::lock_guard<std::mutex> lock (m_queues[i]->m_mutex);
+		m_queues[i]->m_tiles.assign (tiles.begin () + i * tiles.size () / numOfQueues, tiles.begin () + (i + 1) * tiles.size () / numOfQueues);
+	}
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		m_renderTile = &renderTile;
+		m_numOfBusyThreads = m_threads.size ();
+		m_generation++;
+	}
+	m_startCondition.notify_all ();
+	processTiles (0);
+	std::unique_lock<std::mutex> lock (m_mutex);
+	m_doneCondition.wait (lock, [&] { return m_numOfBusyThreads == 0; });
+	m_renderTile = nullptr;
+	if (m_exception) {
+		std::exception_ptr exception = m_exception;
+		m_exception = nullptr;
+		std::rethrow_exception (exception);
+	}
+}
+
+std::vector<TileScheduler::Tile> TileScheduler::makeTiles (const Tile & region) const {
+	size_t width = (region.m_x1 > region.m_x0 ? region.m_x1 - region.m_x0 : 0);
+	size_t height = (region.m_y1 > region.m_y0 ? region.m_y1 - region.m_y0 : 0);
+	size_t numOfTilesX = (width + m_tileSize - 1) / m_tileSize;
+	size_t numOfTilesY = (height + m_tileSize - 1) / m_tileSize;
+	std::vector<std::pair<uint64_t, Tile>> keyedTiles;
+	keyedTiles.reserve (numOfTilesX * numOfTilesY);
+	float cx = 0.5f * (numOfTilesX - 1);
+	float cy = 0.5f * (numOfTilesY - 1);
+	for (size_t ty = 0; ty < numOfTilesY; ty++)
+		for (size_t tx = 0; tx < numOfTilesX; tx++) {
+			Tile tile = { region.m_x0 + tx * m_tileSize, region.m_y0 + ty * m_tileSize,
+						  region.m_x0 + std::min (width, (tx + 1) * m_tileSize), region.m_y0 + std::min (height, (ty + 1) * m_tileSize) };
+			uint64_t key;
+			if (m_order == Order::Morton)
+				key = mortonCode (uint32_t (tx), uint32_t (ty));
+			else {
+				// Ring index first, then angle around the center within the ring.
+				float dx = tx - cx;
+				float dy = ty - cy;
+				uint64_t ring = uint64_t (std::max (std::fabs (dx), std::fabs (dy)));
+				float angle = std::atan2 (dy, dx) + float (M_PI);
+				key = (ring << 32) | uint64_t (angle / (2.f * float (M_PI)) * 65535.f);
+			}
+			keyedTiles.push_back (std::make_pair (key, tile));
+		}
+	std::stable_sort (keyedTiles.begin (), keyedTiles.end (), [] (const std::pair<uint64_t, Tile> & a, const std::pair<uint64_t, Tile> & b) { return a.first < b.first; });
+	std::vector<Tile> tiles;
+	tiles.reserve (keyedTiles.size ());
+	for (const auto & keyedTile : keyedTiles)
+		tiles.push_back (keyedTile.second);
+	return tiles;
+}
+
+bool TileScheduler::nextTile (size_t workerIndex, Tile & tile) {
+	{
+		Queue & queue = *m_queues[workerIndex];
+		std::lock_guard<std::mutex> lock (queue.m_mutex);
+		if (!queue.m_tiles.empty ()) {
+			tile = queue.m_tiles.front ();
+			queue.m_tiles.pop_front ();
+			return true;
+		}
+	}
+	// Steal from the back, farthest from where the owner is working.
+	for (size_t i = 1; i < m_queues.size (); i++) {
+		Queue & victim = *m_queues[(workerIndex + i) % m_queues.size ()];
+		std::lock_guard<std::mutex> lock (victim.m_mutex);
+		if (!victim.m_tiles.empty ()) {
+			tile = victim.m_tiles.back ();
+			victim.m_tiles.pop_back ();
+			return true;
+		}
+	}
+	return false;
+}
+
+void TileScheduler::clearQueues () {
+	for (auto & queue : m_queues) {
+		std::lock_guard<std::mutex> lock (queue->m_mutex);
+		queue->m_tiles.clear ();
+	}
+}
+
+void TileScheduler::processTiles (size_t workerIndex) {
+	// Exceptions must not escape a worker, which would never report itself idle.
+	try {
+		Tile tile;
+		while (nextTile (workerIndex, tile))
+			(*m_renderTile) (tile);
+	} catch (...) {
+		{
+			std::lock_guard<std::mutex> lock (m_mutex);
+			if (!m_exception)
+				m_exception = std::current_exception ();
+		}
+		clearQueues ();
+	}
+}
+
+void TileScheduler::workerLoop (size_t workerIndex) {
+	size_t generation = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock (m_mutex);
+			m_startCondition.wait (lock, [&] { return m_quit || m_generation != generation; });
+			if (m_quit)
+				return;
+			generation = m_generation;
+		}
+		processTiles (workerIndex);
+		{
+			std::lock_guard<std::mutex> lock (m_mutex);
+			if (--m_numOfBusyThreads == 0)
+				m_doneCondition.notify_one ();
+		}
+	}
+}
@@ -0,0 +1,88 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2022 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/// Splits an image into square tiles and renders them on a persistent pool of threads.
+/// Each thread owns a queue of neighboring tiles and steals tiles from the back of the other
+/// queues once its own is empty, so that expensive regions keep all the cores busy.
+class TileScheduler {
+public:
+	/// Pixels [m_x0, m_x1[ x [m_y0, m_y1[ of the image.
+	struct Tile {
+		size_t m_x0;
+		size_t m_y0;
+		size_t m_x1;
+		size_t m_y1;
+	};
+
+	/// Order in which the tiles are dealt to the threads.
+	enum class Order {
+		Morton, ///< Z-order curve: consecutive tiles are close in the image.
+		Spiral  ///< Rings around the image center, which usually holds the subject, outwards.
+	};
+
+	/// The calling thread takes part in the rendering, so numOfThreads - 1 threads are spawned.
+	TileScheduler (size_t numOfThreads = std::thread::hardware_concurrency (), size_t tileSize = 16, Order order = Order::Morton);
+
+	virtual ~TileScheduler ();
+
+	inline size_t numOfThreads () const { return m_queues.size (); }
+
+	inline size_t tileSize () const { return m_tileSize; }
+
+	inline void setTileSize (size_t tileSize) { m_tileSize = std::max<size_t> (1, tileSize); }
+
+	inline Order order () const { return m_order; }
+
+	inline void setOrder (Order order) { m_order = order; }
+
+	/// Calls renderTile on every tile of a width x height image and returns once all are done.
+	/// renderTile is called concurrently on distinct tiles. Not reentrant.
+	/// If renderTile throws, the remaining tiles are dropped and the first exception is rethrown once all the threads are idle.
+	void run (size_t width, size_t height, const std::function<void (const Tile &)> & renderTile);
+
+	/// Same as above, restricted to the tiles covering the region. Tiles are aligned on the region corner and clipped to it.
+	void run (const Tile & region, const std::function<void (const Tile &)> & renderTile);
+
+private:
+	struct Queue {
+		std::mutex m_mutex;
+		std::deque<Tile> m_tiles;
+	};
+
+	std::vector<Tile> makeTiles (const Tile & region) const;
+	bool nextTile (size_t workerIndex, Tile & tile);
+	void clearQueues ();
+	void processTiles (size_t workerIndex);
+	void workerLoop (size_t workerIndex);
+
+	size_t m_tileSize;
+	Order m_order;
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex;
+	std::condition_variable m_startCondition;
+	std::condition_variable m_doneCondition;
+	const std::function<void (const Tile &)> * m_renderTile;
+	size_t m_generation;
+	size_t m_numOfBusyThreads;
+	std::exception_ptr m_exception; ///< First exception thrown by renderTile during the current run.
+	bool m_quit;
+};
@@ -0,0 +1,222 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2020-2024 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#include "TwoLevelBVH.h"
+
+#include <algorithm>
+#include <map>
+
+using namespace std;
+
+// Capacity of the top-level traversal stack, far above the height of a median
+// split hierarchy over any number of instances.
+static const size_t TRAVERSAL_STACK_SIZE = 64;
+
+TwoLevelBVH::TwoLevelBVH(const std::shared_ptr<Scene> scene,
+                         BVH::SplitMethod splitMethod, size_t width) {
+  // Instances of the same mesh share its bottom level.
+  std::map<const Mesh *, uint32_t> bottomLevelIndices;
+  for (size_t i = 0; i < scene->numOfMeshes(); ++i) {
+    const std::shared_ptr<const Mesh> meshPtr = scene->mesh(i);
+    auto it = bottomLevelIndices.find(meshPtr.get());
+    if (it == bottomLevelIndices.end()) {
+      it = bottomLevelIndices
+               .insert(std::make_pair(meshPtr.get(),
+                                      uint32_t(m_bottomLevels.size())))
+               .first;
+      BottomLevel bottomLevel;
+      bottomLevel.m_meshPtr = meshPtr;
+      bottomLevel.m_bvhPtr = std::make_shared<BVH>(meshPtr, splitMethod);
+      if (width > 2)
+        bottomLevel.m_wideBVHPtr =
+            std::make_shared<WideBVH>(bottomLevel.m_bvhPtr, width);
+      m_bottomLevels.push_back(bottomLevel);
+    }
+    Instance instance;
+    instance.m_bottomLevelIndex = it->second;
+    m_instances.push_back(instance);
+  }
+  updateInstances(scene);
+}
+
+TwoLevelBVH::~TwoLevelBVH() {}
+
+void TwoLevelBVH::updateInstances(const std::shared_ptr<Scene> scene) {
+  m_nodes.clear();
+  m_instanceIndices.clear();
+  for (size_t i = 0; i < m_instances.size(); ++i) {
+    Instance &instance = m_instances[i];
+    glm::mat4 modelMatrix = scene->modelMatrix(i);
+    instance.m_worldToObject = glm::inverse(modelMatrix);
+    // World-space bounds of the corners of the object-space bounds.
+    BoundingBox objectBBox =
+        m_bottomLevels[instance.m_bottomLevelIndex].m_bvhPtr->bbox();
+    for (int c = 0; c < 8; ++c) {
+      glm::vec3 corner((c & 1) ? objectBBox.max()[0] : objectBBox.min()[0],
+                       (c & 2) ? objectBBox.max()[1] : objectBBox.min()[1],
+                       (c & 4) ? objectBBox.max()[2] : objectBBox.min()[2]);
+      glm::vec3 p = glm::vec3(modelMatrix * glm::vec4(corner, 1.0));
+      if (c == 0)
+        instance.m_bbox.init(p);
+      else
+        instance.m_bbox.extendTo(p);
+    }
+    // Empty meshes are left out of the top level.
+    if (m_bottomLevels[instance.m_bottomLevelIndex].m_bvhPtr->numOfNodes() > 0)
+      m_instanceIndices.push_back(uint32_t(i));
+  }
+  if (!m_instanceIndices.empty()) {
+    m_nodes.reserve(2 * m_instanceIndices.size());
+    build(0, m_instanceIndices.size());
+  }
+}
+
+size_t TwoLevelBVH::build(size_t begin, size_t end) {
+  BoundingBox bbox = m_instances[m_instanceIndices[begin]].m_bbox;
+  for (size_t i = begin + 1; i < end; ++i)
+    bbox.extendTo(m_instances[m_instanceIndices[i]].m_bbox);
+  size_t nodeIndex = m_nodes.size();
+  m_nodes.push_back(BVH::Node());
+  m_nodes[nodeIndex].m_min = bbox.min();
+  m_nodes[nodeIndex].m_max = bbox.max();
+  if (end - begin == 1) {
+    m_nodes[nodeIndex].m_offset = uint32_t(begin);
+    m_nodes[nodeIndex].m_count = 1;
+    m_nodes[nodeIndex].m_axis = 0;
+    return nodeIndex;
+  }
+  size_t axis = bbox.dominantAxis();
+  size_t mid = (begin + end) / 2;
+  std::nth_element(m_instanceIndices.begin() + int(begin),
+                   m_instanceIndices.begin() + int(mid),
+                   m_instanceIndices.begin() + int(end),
+                   [&](uint32_t i, uint32_t j) {
+                     return (m_instances[i].m_bbox.center()[axis] <
+                             m_instances[j].m_bbox.center()[axis]);
+                   });
+  build(begin, mid);
+  size_t rightIndex = build(mid, end);
+  m_nodes[nodeIndex].m_offset = uint32_t(rightIndex);
+  m_nodes[nodeIndex].m_count = 0;
+  m_nodes[nodeIndex].m_axis = uint16_t(axis);
+  return nodeIndex;
+}
+
+Ray TwoLevelBVH::objectRay(const glm::mat4 &worldToObject, const Ray &r) {
+  return Ray(glm::vec3(worldToObject * glm::vec4(r.origin(), 1.0)),
+             glm::vec3(worldToObject * glm::vec4(r.direction(), 0.0)),
+             r.tMin(), r.tMax());
+}
+
+bool TwoLevelBVH::intersect(const Ray &r, Hit &hit, float tMax) const {
+  if (m_nodes.empty())
+    return false;
+  float closest = std::min(tMax, r.tMax());
+  bool intersectionFound = false;
+  std::pair<uint32_t, float> stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  float n;
+  float f;
+  if (!r.boxIntersect(m_nodes[0].m_min, m_nodes[0].m_max, n, f))
+    return false;
+  stack[stackSize++] = std::make_pair(0u, n);
+  while (stackSize > 0) {
+    --stackSize;
+    if (stack[stackSize].second >= closest)
+      continue;
+    uint32_t nodeIndex = stack[stackSize].first;
+    const BVH::Node &node = m_nodes[nodeIndex];
+    if (node.isLeaf()) {
+      uint32_t instanceIndex = m_instanceIndices[node.m_offset];
+      const Instance &instance = m_instances[instanceIndex];
+      const BottomLevel &bottomLevel =
+          m_bottomLevels[instance.m_bottomLevelIndex];
+      Ray objectR = objectRay(instance.m_worldToObject, r);
+      Hit objectHit;
+      bool found = (bottomLevel.m_wideBVHPtr
+                        ? bottomLevel.m_wideBVHPtr->intersect(objectR,
+                                                              objectHit,
+                                                              closest)
+                        : bottomLevel.m_bvhPtr->intersect(objectR, objectHit,
+                                                          closest));
+      if (found) {
+        intersectionFound = true;
+        closest = objectHit.m_distance;
+        hit = objectHit;
+        hit.m_meshIndex = instanceIndex;
+      }
+    } else {
+      uint32_t leftIndex = nodeIndex + 1;
+      uint32_t rightIndex = node.m_offset;
+      float leftNear, rightNear;
+      bool leftHit = r.boxIntersect(m_nodes[leftIndex].m_min,
+                                    m_nodes[leftIndex].m_max, leftNear, f) &&
+                     leftNear < closest;
+      bool rightHit = r.boxIntersect(m_nodes[rightIndex].m_min,
+                                     m_nodes[rightIndex].m_max, rightNear, f) &&
+                      rightNear < closest;
+      // Push the farther child first so that the nearer one is popped next.
+      if (leftHit && rightHit) {
+        if (leftNear <= rightNear) {
+          stack[stackSize++] = std::make_pair(rightIndex, rightNear);
+          stack[stackSize++] = std::make_pair(leftIndex, leftNear);
+        } else {
+          stack[stackSize++] = std::make_pair(leftIndex, leftNear);
+          stack[stackSize++] = std::make_pair(rightIndex, rightNear);
+        }
+      } else if (leftHit)
+        stack[stackSize++] = std::make_pair(leftIndex, leftNear);
+      else if (rightHit)
+        stack[stackSize++] = std::make_pair(rightIndex, rightNear);
+    }
+  }
+  return intersectionFound;
+}
+
+bool TwoLevelBVH::occluded(const Ray &r, float tMax, size_t excludedMeshIndex,
+                           size_t excludedTriangleIndex) const {
+  if (m_nodes.empty())
+    return false;
+  tMax = std::min(tMax, r.tMax());
+  uint32_t stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize > 0) {
+    uint32_t nodeIndex = stack[--stackSize];
+    const BVH::Node &node = m_nodes[nodeIndex];
+    float n;
+    float f;
+    if (!r.boxIntersect(node.m_min, node.m_max, n, f) || n >= tMax)
+      continue;
+    if (node.isLeaf()) {
+      uint32_t instanceIndex = m_instanceIndices[node.m_offset];
+      const Instance &instance = m_instances[instanceIndex];
+      const BottomLevel &bottomLevel =
+          m_bottomLevels[instance.m_bottomLevelIndex];
+      // The excluded triangle only belongs to the excluded instance, its mesh
+      // being mesh 0 of the bottom level.
+      size_t excludedObjectMeshIndex =
+          (instanceIndex == excludedMeshIndex
+               ? 0
+               : std::numeric_limits<size_t>::max());
+      Ray objectR = objectRay(instance.m_worldToObject, r);
+      if (bottomLevel.m_wideBVHPtr
+              ? bottomLevel.m_wideBVHPtr->occluded(objectR, tMax,
+                                                   excludedObjectMeshIndex,
+                                                   excludedTriangleIndex)
+              : bottomLevel.m_bvhPtr->occluded(objectR, tMax,
+                                               excludedObjectMeshIndex,
+                                               excludedTriangleIndex))
+        return true;
+    } else {
+      stack[stackSize++] = node.m_offset;
+      stack[stackSize++] = nodeIndex + 1;
+    }
+  }
+  return false;
+}
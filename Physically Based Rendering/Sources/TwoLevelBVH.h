@@ -0,0 +1,85 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2020-2024 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <limits>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "BoundingBox.h"
+#include "BVH.h"
+#include "Mesh.h"
+#include "Ray.h"
+#include "Scene.h"
+#include "WideBVH.h"
+
+/// Two-level acceleration structure over the mesh instances of a scene. Each distinct mesh gets a bottom-level BVH
+/// built once in its object space and shared by all its instances. A top-level BVH over the world-space bounds of
+/// the instances leads the rays to the instances they may hit, in whose object space they are then traced.
+/// A transform change thus only rebuilds the top level. Hits report the instance index as mesh index, like the
+/// single-level BVH does with the mesh index.
+class TwoLevelBVH {
+public:
+    /// Builds the bottom level of each distinct mesh of the scene, binary or collapsed into a wide BVH of the given
+    /// width (4 or 8), then the top level from the model matrices cached by the scene, which must be up to date.
+    TwoLevelBVH(const std::shared_ptr<Scene> scene, BVH::SplitMethod splitMethod = BVH::SplitMethod::SAH, size_t width = 2);
+
+    virtual ~TwoLevelBVH();
+
+    inline size_t numOfInstances() const { return m_instances.size(); }
+
+    inline size_t numOfBottomLevels() const { return m_bottomLevels.size(); }
+
+    inline size_t numOfTopLevelNodes() const { return m_nodes.size(); }
+
+    inline BoundingBox bbox() const { return (m_nodes.empty() ? BoundingBox() : BoundingBox(m_nodes[0].m_min, m_nodes[0].m_max)); }
+
+    /// Rebuilds the top level after the transforms of the instances changed and the transform cache of the scene
+    /// was updated. The scene must hold the same meshes as when this hierarchy was built.
+    /// Only the instance bounds are recomputed, the geometry being left in object space.
+    void updateInstances(const std::shared_ptr<Scene> scene);
+
+    /// Closest intersection of r with the scene triangles at a distance in ]0, tMax[, tMax being clipped to r.tMax().
+    bool intersect(const Ray& r, Hit& hit, float tMax = std::numeric_limits<float>::max()) const;
+
+    /// Occlusion query: true as soon as any triangle, other than the excluded one, is found at a distance in ]0, tMax[, tMax being clipped to r.tMax().
+    bool occluded(const Ray& r, float tMax = std::numeric_limits<float>::max(),
+                  size_t excludedMeshIndex = std::numeric_limits<size_t>::max(),
+                  size_t excludedTriangleIndex = std::numeric_limits<size_t>::max()) const;
+
+    /// The ray r transformed into the object space of an instance. Directions are not normalized, so that distances
+    /// along the ray are the same in both spaces.
+    static Ray objectRay(const glm::mat4& worldToObject, const Ray& r);
+
+private:
+    /// Object-space hierarchy of a mesh, shared by all its instances.
+    struct BottomLevel {
+        std::shared_ptr<const Mesh> m_meshPtr;
+        std::shared_ptr<BVH> m_bvhPtr;
+        std::shared_ptr<WideBVH> m_wideBVHPtr;
+    };
+
+    struct Instance {
+        glm::mat4 m_worldToObject;
+        BoundingBox m_bbox;           ///< World-space bounds.
+        uint32_t m_bottomLevelIndex;
+    };
+
+    /// Builds the top-level subtree over m_instanceIndices[begin, end[ with median splits, leaves holding one instance.
+    size_t build(size_t begin, size_t end);
+
+    std::vector<BottomLevel> m_bottomLevels;
+    std::vector<Instance> m_instances;
+    std::vector<BVH::Node> m_nodes;          ///< Top level, laid out as the binary BVH, leaves indexing m_instanceIndices.
+    std::vector<uint32_t> m_instanceIndices;
+};
@@ -0,0 +1,955 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2020-2024 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#include "WideBVH.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WIDE_BVH_SSE
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define WIDE_BVH_TARGET_AVX __attribute__((target("avx")))
+#else
+#define WIDE_BVH_TARGET_AVX
+#endif
+
+using namespace std;
+
+// Capacity of the traversal stack: up to Width - 1 pending children for each
+// of the (at most 64) levels of the binary BVH. The traversals check it anyway
+// before pushing the children of a node, and skip them if they do not fit.
+static const size_t TRAVERSAL_STACK_SIZE = 8 * 64;
+
+// Same threshold as Ray::triangleIntersect.
+static const float TRIANGLE_EPSILON = 0.00000001f;
+
+namespace {
+
+// Ray data shared by all the box tests of a traversal: rows of the node
+// bounds holding the near and far planes along each axis, selected by the
+// direction signs precomputed by the ray.
+struct RayBoxData {
+  float m_origin[3];
+  float m_invDirection[3];
+  int m_nearIndex[3];
+  int m_farIndex[3];
+  float m_tMin;
+};
+
+struct StackEntry {
+  uint32_t m_index;
+  uint16_t m_count;
+  float m_tNear;
+};
+
+// Packet data shared by the interval box tests of a packet traversal: for
+// each axis, the rows of the near and far planes, the origin bounds giving the
+// smallest near and the largest far distances, and the inverse direction
+// bounds.
+struct PacketBoxData {
+  int m_nearIndex[3];
+  int m_farIndex[3];
+  float m_nearOrigin[3];
+  float m_farOrigin[3];
+  float m_invDirectionMin[3];
+  float m_invDirectionMax[3];
+  float m_tMin;
+};
+
+// Node of a packet traversal, entered by the rays of the packet from m_first
+// on, and by none before.
+struct PacketStackEntry {
+  uint32_t m_index;
+  uint16_t m_count;
+  uint8_t m_first;
+  float m_tNear; ///< Lower bound of the entry distances of the rays.
+};
+
+} // namespace
+
+static RayBoxData makeRayBoxData(const Ray &r) {
+  RayBoxData rd;
+  for (int a = 0; a < 3; ++a) {
+    rd.m_origin[a] = r.origin()[a];
+    rd.m_invDirection[a] = r.invDirection()[a];
+    rd.m_nearIndex[a] = a + 3 * r.sign(a);
+    rd.m_farIndex[a] = a + 3 * (1 - r.sign(a));
+  }
+  rd.m_tMin = r.tMin();
+  return rd;
+}
+
+static PacketBoxData makePacketBoxData(const BVH::PacketBounds &bounds) {
+  PacketBoxData pd;
+  for (int a = 0; a < 3; ++a) {
+    pd.m_nearIndex[a] = (bounds.m_positive[a] ? a : a + 3);
+    pd.m_farIndex[a] = (bounds.m_positive[a] ? a + 3 : a);
+    pd.m_nearOrigin[a] =
+        (bounds.m_positive[a] ? bounds.m_originMax[a] : bounds.m_originMin[a]);
+    pd.m_farOrigin[a] =
+        (bounds.m_positive[a] ? bounds.m_originMin[a] : bounds.m_originMax[a]);
+    pd.m_invDirectionMin[a] = bounds.m_invDirectionMin[a];
+    pd.m_invDirectionMax[a] = bounds.m_invDirectionMax[a];
+  }
+  pd.m_tMin = bounds.m_tMin;
+  return pd;
+}
+
+static bool cpuSupportsAVX() {
+#if defined(WIDE_BVH_SSE) && (defined(__GNUC__) || defined(__clang__))
+  return __builtin_cpu_supports("avx");
+#elif defined(WIDE_BVH_SSE) && defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  bool osUsesXSave = (info[2] & (1 << 27)) != 0;
+  bool cpuHasAVX = (info[2] & (1 << 28)) != 0;
+  return osUsesXSave && cpuHasAVX && ((_xgetbv(0) & 0x6) == 0x6);
+#else
+  return false;
+#endif
+}
+
+// Returns the bit mask of the children of node entered by the ray within
+// [tMin, tMax], and stores their entry distances in tNear.
+template <size_t Width>
+static unsigned int boxIntersectScalar(const WideBVH::Node<Width> &node,
+                                       const RayBoxData &rd, float tMax,
+                                       float *tNear) {
+  unsigned int mask = 0;
+  for (size_t i = 0; i < Width; ++i) {
+    float t0 = rd.m_tMin;
+    float t1 = tMax;
+    for (int a = 0; a < 3; ++a) {
+      float tn = (node.m_bounds[rd.m_nearIndex[a]][i] - rd.m_origin[a]) *
+                 rd.m_invDirection[a];
+      float tf = (node.m_bounds[rd.m_farIndex[a]][i] - rd.m_origin[a]) *
+                 rd.m_invDirection[a];
+      t0 = std::max(t0, tn);
+      t1 = std::min(t1, tf);
+    }
+    tNear[i] = t0;
+    if (t0 <= t1)
+      mask |= (1u << i);
+  }
+  return mask;
+}
+
+#ifdef WIDE_BVH_SSE
+static unsigned int boxIntersectSSE(const WideBVH::Node<4> &node,
+                                    const RayBoxData &rd, float tMax,
+                                    float *tNear) {
+  __m128 t0 = _mm_set1_ps(rd.m_tMin);
+  __m128 t1 = _mm_set1_ps(tMax);
+  for (int a = 0; a < 3; ++a) {
+    __m128 o = _mm_set1_ps(rd.m_origin[a]);
+    __m128 invD = _mm_set1_ps(rd.m_invDirection[a]);
+    __m128 tn = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(node.m_bounds[rd.m_nearIndex[a]]), o), invD);
+    __m128 tf = _mm_mul_ps(
+        _mm_sub_ps(_mm_loadu_ps(node.m_bounds[rd.m_farIndex[a]]), o), invD);
+    // Operand order matters: a NaN (0 * inf) in tn or tf keeps the current
+    // bound, as in the scalar version.
+    t0 = _mm_max_ps(tn, t0);
+    t1 = _mm_min_ps(tf, t1);
+  }
+  _mm_storeu_ps(tNear, t0);
+  return (unsigned int)_mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+WIDE_BVH_TARGET_AVX
+static unsigned int boxIntersectAVX(const WideBVH::Node<8> &node,
+                                    const RayBoxData &rd, float tMax,
+                                    float *tNear) {
+  __m256 t0 = _mm256_set1_ps(rd.m_tMin);
+  __m256 t1 = _mm256_set1_ps(tMax);
+  for (int a = 0; a < 3; ++a) {
+    __m256 o = _mm256_set1_ps(rd.m_origin[a]);
+    __m256 invD = _mm256_set1_ps(rd.m_invDirection[a]);
+    __m256 tn = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(node.m_bounds[rd.m_nearIndex[a]]), o),
+        invD);
+    __m256 tf = _mm256_mul_ps(
+        _mm256_sub_ps(_mm256_loadu_ps(node.m_bounds[rd.m_farIndex[a]]), o),
+        invD);
+    t0 = _mm256_max_ps(tn, t0);
+    t1 = _mm256_min_ps(tf, t1);
+  }
+  _mm256_storeu_ps(tNear, t0);
+  return (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+static inline unsigned int boxIntersect(const WideBVH::Node<4> &node,
+                                        const RayBoxData &rd, float tMax,
+                                        float *tNear) {
+#ifdef WIDE_BVH_SSE
+  return boxIntersectSSE(node, rd, tMax, tNear);
+#else
+  return boxIntersectScalar<4>(node, rd, tMax, tNear);
+#endif
+}
+
+static inline unsigned int boxIntersect(const WideBVH::Node<8> &node,
+                                        const RayBoxData &rd, float tMax,
+                                        float *tNear) {
+#ifdef WIDE_BVH_SSE
+  static const bool useAVX = cpuSupportsAVX();
+  if (useAVX)
+    return boxIntersectAVX(node, rd, tMax, tNear);
+#endif
+  return boxIntersectScalar<8>(node, rd, tMax, tNear);
+}
+
+// Interval arithmetic version of boxIntersect: returns the bit mask of the
+// children of node that some ray of the packet may enter within [tMin, tMax],
+// and stores lower bounds of their entry distances in tNear. The finite
+// inverse directions of a packet keep the empty slots out, without NaN.
+template <size_t Width>
+static unsigned int packetBoxIntersectScalar(const WideBVH::Node<Width> &node,
+                                             const PacketBoxData &pd,
+                                             float tMax, float *tNear) {
+  unsigned int mask = 0;
+  for (size_t i = 0; i < Width; ++i) {
+    float t0 = pd.m_tMin;
+    float t1 = tMax;
+    for (int a = 0; a < 3; ++a) {
+      float n = node.m_bounds[pd.m_nearIndex[a]][i] - pd.m_nearOrigin[a];
+      float f = node.m_bounds[pd.m_farIndex[a]][i] - pd.m_farOrigin[a];
+      t0 = std::max(t0, std::min(n * pd.m_invDirectionMin[a],
+                                 n * pd.m_invDirectionMax[a]));
+      t1 = std::min(t1, std::max(f * pd.m_invDirectionMin[a],
+                                 f * pd.m_invDirectionMax[a]));
+    }
+    tNear[i] = t0;
+    if (t0 <= t1)
+      mask |= (1u << i);
+  }
+  return mask;
+}
+
+#ifdef WIDE_BVH_SSE
+static unsigned int packetBoxIntersectSSE(const WideBVH::Node<4> &node,
+                                          const PacketBoxData &pd, float tMax,
+                                          float *tNear) {
+  __m128 t0 = _mm_set1_ps(pd.m_tMin);
+  __m128 t1 = _mm_set1_ps(tMax);
+  for (int a = 0; a < 3; ++a) {
+    __m128 invMin = _mm_set1_ps(pd.m_invDirectionMin[a]);
+    __m128 invMax = _mm_set1_ps(pd.m_invDirectionMax[a]);
+    __m128 n = _mm_sub_ps(_mm_loadu_ps(node.m_bounds[pd.m_nearIndex[a]]),
+                          _mm_set1_ps(pd.m_nearOrigin[a]));
+    __m128 f = _mm_sub_ps(_mm_loadu_ps(node.m_bounds[pd.m_farIndex[a]]),
+                          _mm_set1_ps(pd.m_farOrigin[a]));
+    t0 = _mm_max_ps(_mm_min_ps(_mm_mul_ps(n, invMin), _mm_mul_ps(n, invMax)),
+                    t0);
+    t1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(f, invMin), _mm_mul_ps(f, invMax)),
+                    t1);
+  }
+  _mm_storeu_ps(tNear, t0);
+  return (unsigned int)_mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+WIDE_BVH_TARGET_AVX
+static unsigned int packetBoxIntersectAVX(const WideBVH::Node<8> &node,
+                                          const PacketBoxData &pd, float tMax,
+                                          float *tNear) {
+  __m256 t0 = _mm256_set1_ps(pd.m_tMin);
+  __m256 t1 = _mm256_set1_ps(tMax);
+  for (int a = 0; a < 3; ++a) {
+    __m256 invMin = _mm256_set1_ps(pd.m_invDirectionMin[a]);
+    __m256 invMax = _mm256_set1_ps(pd.m_invDirectionMax[a]);
+    __m256 n = _mm256_sub_ps(_mm256_loadu_ps(node.m_bounds[pd.m_nearIndex[a]]),
+                             _mm256_set1_ps(pd.m_nearOrigin[a]));
+    __m256 f = _mm256_sub_ps(_mm256_loadu_ps(node.m_bounds[pd.m_farIndex[a]]),
+                             _mm256_set1_ps(pd.m_farOrigin[a]));
+    t0 = _mm256_max_ps(
+        _mm256_min_ps(_mm256_mul_ps(n, invMin), _mm256_mul_ps(n, invMax)), t0);
+    t1 = _mm256_min_ps(
+        _mm256_max_ps(_mm256_mul_ps(f, invMin), _mm256_mul_ps(f, invMax)), t1);
+  }
+  _mm256_storeu_ps(tNear, t0);
+  return (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+static inline unsigned int packetBoxIntersect(const WideBVH::Node<4> &node,
+                                              const PacketBoxData &pd,
+                                              float tMax, float *tNear) {
+#ifdef WIDE_BVH_SSE
+  return packetBoxIntersectSSE(node, pd, tMax, tNear);
+#else
+  return packetBoxIntersectScalar<4>(node, pd, tMax, tNear);
+#endif
+}
+
+static inline unsigned int packetBoxIntersect(const WideBVH::Node<8> &node,
+                                              const PacketBoxData &pd,
+                                              float tMax, float *tNear) {
+#ifdef WIDE_BVH_SSE
+  static const bool useAVX = cpuSupportsAVX();
+  if (useAVX)
+    return packetBoxIntersectAVX(node, pd, tMax, tNear);
+#endif
+  return packetBoxIntersectScalar<8>(node, pd, tMax, tNear);
+}
+
+// Moller-Trumbore test of a ray against every triangle of a pack, with the
+// same sequence of operations as Ray::triangleIntersect. Returns the bit mask
+// of the lanes hit at a distance in ]0, tMax[ and stores their barycentric
+// coordinates and distances.
+template <size_t Width>
+static unsigned int packIntersectScalar(const WideBVH::TrianglePack<Width> &pack,
+                                        const Ray &r, float tMax, float *u,
+                                        float *v, float *t) {
+  const glm::vec3 &o = r.origin();
+  const glm::vec3 &d = r.direction();
+  unsigned int mask = 0;
+  for (size_t i = 0; i < Width; ++i) {
+    glm::vec3 p0(pack.m_p0[0][i], pack.m_p0[1][i], pack.m_p0[2][i]);
+    glm::vec3 e1(pack.m_e1[0][i], pack.m_e1[1][i], pack.m_e1[2][i]);
+    glm::vec3 e2(pack.m_e2[0][i], pack.m_e2[1][i], pack.m_e2[2][i]);
+    glm::vec3 dxe2 = glm::cross(d, e2);
+    float det = glm::dot(e1, dxe2);
+    if (std::fabs(det) < TRIANGLE_EPSILON)
+      continue;
+    float invDet = 1.f / det;
+    glm::vec3 op0 = o - p0;
+    glm::vec3 op0xe1 = glm::cross(op0, e1);
+    u[i] = glm::dot(op0, dxe2) * invDet;
+    v[i] = glm::dot(d, op0xe1) * invDet;
+    t[i] = glm::dot(e2, op0xe1) * invDet;
+    if (u[i] >= 0.f && u[i] <= 1.f && v[i] >= 0.f && u[i] + v[i] <= 1.f &&
+        t[i] > 0.f && t[i] < tMax)
+      mask |= (1u << i);
+  }
+  return mask;
+}
+
+#ifdef WIDE_BVH_SSE
+static unsigned int packIntersectSSE(const WideBVH::TrianglePack<4> &pack,
+                                     const Ray &r, float tMax, float *u,
+                                     float *v, float *t) {
+  __m128 ox = _mm_set1_ps(r.origin()[0]);
+  __m128 oy = _mm_set1_ps(r.origin()[1]);
+  __m128 oz = _mm_set1_ps(r.origin()[2]);
+  __m128 dx = _mm_set1_ps(r.direction()[0]);
+  __m128 dy = _mm_set1_ps(r.direction()[1]);
+  __m128 dz = _mm_set1_ps(r.direction()[2]);
+  __m128 e1x = _mm_loadu_ps(pack.m_e1[0]);
+  __m128 e1y = _mm_loadu_ps(pack.m_e1[1]);
+  __m128 e1z = _mm_loadu_ps(pack.m_e1[2]);
+  __m128 e2x = _mm_loadu_ps(pack.m_e2[0]);
+  __m128 e2y = _mm_loadu_ps(pack.m_e2[1]);
+  __m128 e2z = _mm_loadu_ps(pack.m_e2[2]);
+  // dxe2 = cross(d, e2)
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+  __m128 det = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+  __m128 invDet = _mm_div_ps(_mm_set1_ps(1.f), det);
+  __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.f), det);
+  __m128 valid = _mm_cmpnlt_ps(absDet, _mm_set1_ps(TRIANGLE_EPSILON));
+  // op0 = o - p0, op0xe1 = cross(op0, e1)
+  __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(pack.m_p0[0]));
+  __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(pack.m_p0[1]));
+  __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(pack.m_p0[2]));
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(e1y, sz));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(e1z, sx));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(e1x, sy));
+  __m128 uu = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)),
+                 _mm_mul_ps(sz, pz)),
+      invDet);
+  __m128 vv = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                 _mm_mul_ps(dz, qz)),
+      invDet);
+  __m128 tt = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                 _mm_mul_ps(e2z, qz)),
+      invDet);
+  __m128 zero = _mm_setzero_ps();
+  __m128 one = _mm_set1_ps(1.f);
+  valid = _mm_and_ps(valid, _mm_cmpge_ps(uu, zero));
+  valid = _mm_and_ps(valid, _mm_cmple_ps(uu, one));
+  valid = _mm_and_ps(valid, _mm_cmpge_ps(vv, zero));
+  valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(uu, vv), one));
+  valid = _mm_and_ps(valid, _mm_cmpgt_ps(tt, zero));
+  valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_set1_ps(tMax)));
+  _mm_storeu_ps(u, uu);
+  _mm_storeu_ps(v, vv);
+  _mm_storeu_ps(t, tt);
+  return (unsigned int)_mm_movemask_ps(valid);
+}
+
+WIDE_BVH_TARGET_AVX
+static unsigned int packIntersectAVX(const WideBVH::TrianglePack<8> &pack,
+                                     const Ray &r, float tMax, float *u,
+                                     float *v, float *t) {
+  __m256 ox = _mm256_set1_ps(r.origin()[0]);
+  __m256 oy = _mm256_set1_ps(r.origin()[1]);
+  __m256 oz = _mm256_set1_ps(r.origin()[2]);
+  __m256 dx = _mm256_set1_ps(r.direction()[0]);
+  __m256 dy = _mm256_set1_ps(r.direction()[1]);
+  __m256 dz = _mm256_set1_ps(r.direction()[2]);
+  __m256 e1x = _mm256_loadu_ps(pack.m_e1[0]);
+  __m256 e1y = _mm256_loadu_ps(pack.m_e1[1]);
+  __m256 e1z = _mm256_loadu_ps(pack.m_e1[2]);
+  __m256 e2x = _mm256_loadu_ps(pack.m_e2[0]);
+  __m256 e2y = _mm256_loadu_ps(pack.m_e2[1]);
+  __m256 e2z = _mm256_loadu_ps(pack.m_e2[2]);
+  __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+  __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+  __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+  __m256 det = _mm256_add_ps(
+      _mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+      _mm256_mul_ps(e1z, pz));
+  __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+  __m256 absDet = _mm256_andnot_ps(_mm256_set1_ps(-0.f), det);
+  __m256 valid =
+      _mm256_cmp_ps(absDet, _mm256_set1_ps(TRIANGLE_EPSILON), _CMP_NLT_UQ);
+  __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(pack.m_p0[0]));
+  __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(pack.m_p0[1]));
+  __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(pack.m_p0[2]));
+  __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(e1y, sz));
+  __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(e1z, sx));
+  __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(e1x, sy));
+  __m256 uu = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)),
+                    _mm256_mul_ps(sz, pz)),
+      invDet);
+  __m256 vv = _mm256_mul_ps(
+      _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                    _mm256_mul_ps(dz, qz)),
+      invDet);
+  __m256 tt = _mm256_mul_ps(
+      _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+          _mm256_mul_ps(e2z, qz)),
+      invDet);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 one = _mm256_set1_ps(1.f);
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(uu, zero, _CMP_GE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(uu, one, _CMP_LE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(vv, zero, _CMP_GE_OQ));
+  valid = _mm256_and_ps(
+      valid, _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ));
+  valid = _mm256_and_ps(valid, _mm256_cmp_ps(tt, zero, _CMP_GT_OQ));
+  valid = _mm256_and_ps(
+      valid, _mm256_cmp_ps(tt, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+  _mm256_storeu_ps(u, uu);
+  _mm256_storeu_ps(v, vv);
+  _mm256_storeu_ps(t, tt);
+  return (unsigned int)_mm256_movemask_ps(valid);
+}
+#endif
+
+static inline unsigned int packIntersect(const WideBVH::TrianglePack<4> &pack,
+                                         const Ray &r, float tMax, float *u,
+                                         float *v, float *t) {
+#ifdef WIDE_BVH_SSE
+  return packIntersectSSE(pack, r, tMax, u, v, t);
+#else
+  return packIntersectScalar<4>(pack, r, tMax, u, v, t);
+#endif
+}
+
+static inline unsigned int packIntersect(const WideBVH::TrianglePack<8> &pack,
+                                         const Ray &r, float tMax, float *u,
+                                         float *v, float *t) {
+#ifdef WIDE_BVH_SSE
+  static const bool useAVX = cpuSupportsAVX();
+  if (useAVX)
+    return packIntersectAVX(pack, r, tMax, u, v, t);
+#endif
+  return packIntersectScalar<8>(pack, r, tMax, u, v, t);
+}
+
+// Lane of the nearest hit of a pack, the first one in case of a tie, or -1.
+template <size_t Width>
+static int packClosestHit(const WideBVH::TrianglePack<Width> &pack,
+                          const Ray &r, float tMax, float &u, float &v,
+                          float &t) {
+  float us[Width], vs[Width], ts[Width];
+  unsigned int mask = packIntersect(pack, r, tMax, us, vs, ts);
+  int lane = -1;
+  for (int i = 0; mask != 0; ++i, mask >>= 1)
+    if ((mask & 1u) && (lane < 0 || ts[i] < ts[lane]))
+      lane = i;
+  if (lane >= 0) {
+    u = us[lane];
+    v = vs[lane];
+    t = ts[lane];
+  }
+  return lane;
+}
+
+size_t WideBVH::preferredWidth() { return (isSIMDWidth(8) ? 8 : 4); }
+
+bool WideBVH::isSIMDWidth(size_t width) {
+#ifdef WIDE_BVH_SSE
+  static const bool hasAVX = cpuSupportsAVX();
+  return (width == 4 || (width == 8 && hasAVX));
+#else
+  return false;
+#endif
+}
+
+WideBVH::WideBVH(const std::shared_ptr<const BVH> bvh, size_t width)
+    : m_bvhPtr(bvh), m_width(width == 8 ? 8 : 4) {
+  const auto &binaryNodes = m_bvhPtr->nodes();
+  if (binaryNodes.empty())
+    return;
+  // Triangles of a binary subtree are contiguous, and children follow their
+  // parent in the node array.
+  std::vector<std::pair<uint32_t, uint32_t>> subtreeRanges(binaryNodes.size());
+  for (size_t i = binaryNodes.size(); i-- > 0;) {
+    const BVH::Node &node = binaryNodes[i];
+    if (node.isLeaf())
+      subtreeRanges[i] = std::make_pair(node.m_offset, uint32_t(node.m_count));
+    else
+      subtreeRanges[i] =
+          std::make_pair(subtreeRanges[i + 1].first,
+                         subtreeRanges[i + 1].second +
+                             subtreeRanges[node.m_offset].second);
+  }
+  if (m_width == 8)
+    collapse<8>(0, subtreeRanges, m_nodes8, m_packs8);
+  else
+    collapse<4>(0, subtreeRanges, m_nodes4, m_packs4);
+}
+
+WideBVH::~WideBVH() {}
+
+template <size_t Width>
+uint32_t WideBVH::collapse(
+    uint32_t binaryNodeIndex,
+    const std::vector<std::pair<uint32_t, uint32_t>> &subtreeRanges,
+    std::vector<Node<Width>> &nodes,
+    std::vector<TrianglePack<Width>> &packs) const {
+  const auto &binaryNodes = m_bvhPtr->nodes();
+  auto isLeafSlot = [&](uint32_t i) {
+    return (binaryNodes[i].isLeaf() || subtreeRanges[i].second <= Width);
+  };
+  // Gather up to Width binary descendants by repeatedly opening the interior
+  // one with the largest surface area.
+  uint32_t slots[Width];
+  size_t numOfSlots = 0;
+  if (isLeafSlot(binaryNodeIndex))
+    slots[numOfSlots++] = binaryNodeIndex;
+  else {
+    slots[numOfSlots++] = binaryNodeIndex + 1;
+    slots[numOfSlots++] = binaryNodes[binaryNodeIndex].m_offset;
+  }
+  while (numOfSlots < Width) {
+    size_t best = Width;
+    float bestArea = -1.f;
+    for (size_t i = 0; i < numOfSlots; ++i) {
+      if (isLeafSlot(slots[i]))
+        continue;
+      const BVH::Node &child = binaryNodes[slots[i]];
+      float area = BoundingBox(child.m_min, child.m_max).area();
+      if (area > bestArea) {
+        bestArea = area;
+        best = i;
+      }
+    }
+    if (best == Width)
+      break;
+    uint32_t opened = slots[best];
+    slots[best] = opened + 1;
+    slots[numOfSlots++] = binaryNodes[opened].m_offset;
+  }
+
+  const auto &V = m_bvhPtr->triangleVertices();
+  uint32_t nodeIndex = uint32_t(nodes.size());
+  nodes.push_back(Node<Width>());
+  for (size_t i = 0; i < Width; ++i) {
+    Node<Width> &node = nodes[nodeIndex];
+    if (i >= numOfSlots) {
+      // Empty slot: an inverted box, which rays with NaN components still
+      // enter, hence the sentinel child.
+      for (int a = 0; a < 3; ++a) {
+        node.m_bounds[a][i] = std::numeric_limits<float>::infinity();
+        node.m_bounds[a + 3][i] = -std::numeric_limits<float>::infinity();
+      }
+      node.m_children[i] = EMPTY_SLOT;
+      node.m_counts[i] = 0;
+      continue;
+    }
+    const BVH::Node &child = binaryNodes[slots[i]];
+    for (int a = 0; a < 3; ++a) {
+      node.m_bounds[a][i] = child.m_min[a];
+      node.m_bounds[a + 3][i] = child.m_max[a];
+    }
+    if (isLeafSlot(slots[i])) {
+      uint32_t first = subtreeRanges[slots[i]].first;
+      uint32_t count = subtreeRanges[slots[i]].second;
+      TrianglePack<Width> pack = {};
+      for (uint32_t j = 0; j < count; ++j) {
+        const glm::vec3 &p0 = V[3 * (first + j)];
+        glm::vec3 e1 = V[3 * (first + j) + 1] - p0;
+        glm::vec3 e2 = V[3 * (first + j) + 2] - p0;
+        for (int a = 0; a < 3; ++a) {
+          pack.m_p0[a][j] = p0[a];
+          pack.m_e1[a][j] = e1[a];
+          pack.m_e2[a][j] = e2[a];
+        }
+        pack.m_indices[j] = first + j;
+      }
+      node.m_children[i] = uint32_t(packs.size());
+      node.m_counts[i] = uint16_t(count);
+      packs.push_back(pack);
+    } else {
+      node.m_counts[i] = 0;
+      // The recursion may reallocate the node array.
+      uint32_t childIndex = collapse<Width>(slots[i], subtreeRanges, nodes, packs);
+      nodes[nodeIndex].m_children[i] = childIndex;
+    }
+  }
+  return nodeIndex;
+}
+
+bool WideBVH::intersect(const Ray &r, Hit &hit, float tMax) const {
+  if (m_width == 8)
+    return intersect<8>(m_nodes8, m_packs8, r, hit, tMax);
+  return intersect<4>(m_nodes4, m_packs4, r, hit, tMax);
+}
+
+bool WideBVH::occluded(const Ray &r, float tMax, size_t excludedMeshIndex,
+                       size_t excludedTriangleIndex) const {
+  if (m_width == 8)
+    return occluded<8>(m_nodes8, m_packs8, r, tMax, excludedMeshIndex,
+                       excludedTriangleIndex);
+  return occluded<4>(m_nodes4, m_packs4, r, tMax, excludedMeshIndex,
+                     excludedTriangleIndex);
+}
+
+template <size_t Width>
+bool WideBVH::intersect(const std::vector<Node<Width>> &nodes,
+                        const std::vector<TrianglePack<Width>> &packs,
+                        const Ray &r, Hit &hit, float tMax) const {
+  if (nodes.empty())
+    return false;
+  const auto &indexPairs = m_bvhPtr->indexPairs();
+  RayBoxData rd = makeRayBoxData(r);
+  float closest = std::min(tMax, r.tMax());
+  bool intersectionFound = false;
+  StackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {0, 0, rd.m_tMin};
+  while (stackSize > 0) {
+    StackEntry entry = stack[--stackSize];
+    if (entry.m_tNear >= closest)
+      continue;
+    if (entry.m_count > 0) {
+      const TrianglePack<Width> &pack = packs[entry.m_index];
+      float ut, vt, dt;
+      int lane = packClosestHit(pack, r, closest, ut, vt, dt);
+      if (lane >= 0) {
+        intersectionFound = true;
+        closest = dt;
+        const auto &indexPair = indexPairs[pack.m_indices[lane]];
+        hit.m_meshIndex = indexPair.first;
+        hit.m_triangleIndex = indexPair.second;
+        hit.m_uCoord = ut;
+        hit.m_vCoord = vt;
+        hit.m_distance = dt;
+      }
+      continue;
+    }
+    if (stackSize + Width > TRAVERSAL_STACK_SIZE)
+      continue;
+    const Node<Width> &node = nodes[entry.m_index];
+    float tNear[Width];
+    unsigned int mask = boxIntersect(node, rd, closest, tNear);
+    // Push the children entered by the ray sorted by decreasing entry
+    // distance, so that the nearest one is popped first.
+    size_t first = stackSize;
+    for (size_t i = 0; i < Width; ++i) {
+      if ((mask & (1u << i)) == 0 || node.m_children[i] == EMPTY_SLOT)
+        continue;
+      StackEntry child = {node.m_children[i], node.m_counts[i], tNear[i]};
+      size_t j = stackSize++;
+      while (j > first && stack[j - 1].m_tNear < child.m_tNear) {
+        stack[j] = stack[j - 1];
+        --j;
+      }
+      stack[j] = child;
+    }
+  }
+  return intersectionFound;
+}
+
+template <size_t Width>
+bool WideBVH::occluded(const std::vector<Node<Width>> &nodes,
+                       const std::vector<TrianglePack<Width>> &packs,
+                       const Ray &r, float tMax, size_t excludedMeshIndex,
+                       size_t excludedTriangleIndex) const {
+  if (nodes.empty())
+    return false;
+  const auto &indexPairs = m_bvhPtr->indexPairs();
+  RayBoxData rd = makeRayBoxData(r);
+  tMax = std::min(tMax, r.tMax());
+  StackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {0, 0, rd.m_tMin};
+  while (stackSize > 0) {
+    StackEntry entry = stack[--stackSize];
+    if (entry.m_count > 0) {
+      const TrianglePack<Width> &pack = packs[entry.m_index];
+      float ut[Width], vt[Width], dt[Width];
+      unsigned int mask = packIntersect(pack, r, tMax, ut, vt, dt);
+      for (int i = 0; mask != 0; ++i, mask >>= 1) {
+        if ((mask & 1u) == 0)
+          continue;
+        const auto &indexPair = indexPairs[pack.m_indices[i]];
+        if (indexPair.first != excludedMeshIndex ||
+            indexPair.second != excludedTriangleIndex)
+          return true;
+      }
+      continue;
+    }
+    if (stackSize + Width > TRAVERSAL_STACK_SIZE)
+      continue;
+    const Node<Width> &node = nodes[entry.m_index];
+    float tNear[Width];
+    unsigned int mask = boxIntersect(node, rd, tMax, tNear);
+    for (size_t i = 0; i < Width; ++i)
+      if ((mask & (1u << i)) && node.m_children[i] != EMPTY_SLOT)
+        stack[stackSize++] = {node.m_children[i], node.m_counts[i], tNear[i]};
+  }
+  return false;
+}
+
+void WideBVH::intersect(const Ray *rays, size_t numOfRays, Hit *hits,
+                        bool *found, float tMax) const {
+  if (m_width == 8)
+    intersect<8>(m_nodes8, m_packs8, rays, numOfRays, hits, found, tMax);
+  else
+    intersect<4>(m_nodes4, m_packs4, rays, numOfRays, hits, found, tMax);
+}
+
+void WideBVH::occluded(const Ray *rays, size_t numOfRays, const float *tMax,
+                       const size_t *excludedMeshIndices,
+                       const size_t *excludedTriangleIndices,
+                       bool *occluded) const {
+  if (m_width == 8)
+    this->occluded<8>(m_nodes8, m_packs8, rays, numOfRays, tMax,
+                      excludedMeshIndices, excludedTriangleIndices, occluded);
+  else
+    this->occluded<4>(m_nodes4, m_packs4, rays, numOfRays, tMax,
+                      excludedMeshIndices, excludedTriangleIndices, occluded);
+}
+
+template <size_t Width>
+void WideBVH::intersect(const std::vector<Node<Width>> &nodes,
+                        const std::vector<TrianglePack<Width>> &packs,
+                        const Ray *rays, size_t numOfRays, Hit *hits,
+                        bool *found, float tMax) const {
+  for (; numOfRays > BVH::MAX_PACKET_SIZE;
+       numOfRays -= BVH::MAX_PACKET_SIZE) {
+    intersect<Width>(nodes, packs, rays, BVH::MAX_PACKET_SIZE, hits, found,
+                     tMax);
+    rays += BVH::MAX_PACKET_SIZE;
+    hits += BVH::MAX_PACKET_SIZE;
+    found += BVH::MAX_PACKET_SIZE;
+  }
+  BVH::PacketBounds bounds;
+  if (nodes.empty() || !bounds.compute(rays, numOfRays)) {
+    for (size_t i = 0; i < numOfRays; ++i)
+      found[i] = intersect<Width>(nodes, packs, rays[i], hits[i], tMax);
+    return;
+  }
+  const auto &indexPairs = m_bvhPtr->indexPairs();
+  PacketBoxData pd = makePacketBoxData(bounds);
+  RayBoxData rd[BVH::MAX_PACKET_SIZE];
+  float closest[BVH::MAX_PACKET_SIZE];
+  float maxClosest = 0.f;
+  for (size_t i = 0; i < numOfRays; ++i) {
+    rd[i] = makeRayBoxData(rays[i]);
+    closest[i] = std::min(tMax, rays[i].tMax());
+    maxClosest = std::max(maxClosest, closest[i]);
+    found[i] = false;
+  }
+  PacketStackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {0, 0, 0, pd.m_tMin};
+  while (stackSize > 0) {
+    PacketStackEntry entry = stack[--stackSize];
+    if (entry.m_tNear >= maxClosest)
+      continue;
+    if (entry.m_count > 0) {
+      const TrianglePack<Width> &pack = packs[entry.m_index];
+      for (size_t j = entry.m_first; j < numOfRays; ++j) {
+        float ut, vt, dt;
+        int lane = packClosestHit(pack, rays[j], closest[j], ut, vt, dt);
+        if (lane >= 0) {
+          found[j] = true;
+          closest[j] = dt;
+          const auto &indexPair = indexPairs[pack.m_indices[lane]];
+          hits[j].m_meshIndex = indexPair.first;
+          hits[j].m_triangleIndex = indexPair.second;
+          hits[j].m_uCoord = ut;
+          hits[j].m_vCoord = vt;
+          hits[j].m_distance = dt;
+        }
+      }
+      maxClosest = *std::max_element(closest, closest + numOfRays);
+      continue;
+    }
+    if (stackSize + Width > TRAVERSAL_STACK_SIZE)
+      continue;
+    const Node<Width> &node = nodes[entry.m_index];
+    float tNear[Width];
+    unsigned int mask = packetBoxIntersect(node, pd, maxClosest, tNear);
+    // Coherent rays enter the same children, so the first ray tested usually
+    // finds all of them; its entry distances order the children.
+    uint8_t firstRays[Width];
+    float firstNear[Width];
+    unsigned int pending = mask;
+    for (size_t j = entry.m_first; pending != 0 && j < numOfRays; ++j) {
+      float rayNear[Width];
+      unsigned int entered =
+          boxIntersect(node, rd[j], closest[j], rayNear) & pending;
+      pending &= ~entered;
+      for (size_t i = 0; entered != 0; ++i, entered >>= 1)
+        if (entered & 1u) {
+          firstRays[i] = uint8_t(j);
+          firstNear[i] = rayNear[i];
+        }
+    }
+    mask &= ~pending;
+    // Push the children sorted by decreasing entry distance of their first
+    // ray, so that the nearest one is popped first.
+    size_t first = stackSize;
+    float keys[Width];
+    for (size_t i = 0; i < Width; ++i) {
+      if ((mask & (1u << i)) == 0 || node.m_children[i] == EMPTY_SLOT)
+        continue;
+      PacketStackEntry child = {node.m_children[i], node.m_counts[i],
+                                firstRays[i], tNear[i]};
+      size_t j = stackSize++;
+      while (j > first && keys[j - 1 - first] < firstNear[i]) {
+        stack[j] = stack[j - 1];
+        keys[j - first] = keys[j - 1 - first];
+        --j;
+      }
+      stack[j] = child;
+      keys[j - first] = firstNear[i];
+    }
+  }
+}
+
+template <size_t Width>
+void WideBVH::occluded(const std::vector<Node<Width>> &nodes,
+                       const std::vector<TrianglePack<Width>> &packs,
+                       const Ray *rays, size_t numOfRays, const float *tMax,
+                       const size_t *excludedMeshIndices,
+                       const size_t *excludedTriangleIndices,
+                       bool *occluded) const {
+  for (; numOfRays > BVH::MAX_PACKET_SIZE;
+       numOfRays -= BVH::MAX_PACKET_SIZE) {
+    this->occluded<Width>(nodes, packs, rays, BVH::MAX_PACKET_SIZE, tMax,
+                          excludedMeshIndices, excludedTriangleIndices,
+                          occluded);
+    rays += BVH::MAX_PACKET_SIZE;
+    tMax += BVH::MAX_PACKET_SIZE;
+    excludedMeshIndices += BVH::MAX_PACKET_SIZE;
+    excludedTriangleIndices += BVH::MAX_PACKET_SIZE;
+    occluded += BVH::MAX_PACKET_SIZE;
+  }
+  BVH::PacketBounds bounds;
+  if (nodes.empty() || !bounds.compute(rays, numOfRays)) {
+    for (size_t i = 0; i < numOfRays; ++i)
+      occluded[i] = this->occluded<Width>(nodes, packs, rays[i], tMax[i],
+                                          excludedMeshIndices[i],
+                                          excludedTriangleIndices[i]);
+    return;
+  }
+  const auto &indexPairs = m_bvhPtr->indexPairs();
+  PacketBoxData pd = makePacketBoxData(bounds);
+  RayBoxData rd[BVH::MAX_PACKET_SIZE];
+  float limits[BVH::MAX_PACKET_SIZE];
+  float maxLimit = 0.f;
+  for (size_t i = 0; i < numOfRays; ++i) {
+    rd[i] = makeRayBoxData(rays[i]);
+    limits[i] = std::min(tMax[i], rays[i].tMax());
+    maxLimit = std::max(maxLimit, limits[i]);
+    occluded[i] = false;
+  }
+  size_t numOfActiveRays = numOfRays;
+  PacketStackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {0, 0, 0, pd.m_tMin};
+  while (stackSize > 0) {
+    PacketStackEntry entry = stack[--stackSize];
+    if (entry.m_tNear >= maxLimit)
+      continue;
+    if (entry.m_count > 0) {
+      const TrianglePack<Width> &pack = packs[entry.m_index];
+      bool isOccluded = false;
+      for (size_t j = entry.m_first; j < numOfRays; ++j) {
+        if (occluded[j])
+          continue;
+        float ut[Width], vt[Width], dt[Width];
+        unsigned int mask = packIntersect(pack, rays[j], limits[j], ut, vt, dt);
+        for (int i = 0; mask != 0; ++i, mask >>= 1) {
+          if ((mask & 1u) == 0)
+            continue;
+          const auto &indexPair = indexPairs[pack.m_indices[i]];
+          if (indexPair.first != excludedMeshIndices[j] ||
+              indexPair.second != excludedTriangleIndices[j]) {
+            occluded[j] = true;
+            limits[j] = 0.f;
+            isOccluded = true;
+            --numOfActiveRays;
+            break;
+          }
+        }
+      }
+      if (numOfActiveRays == 0)
+        return;
+      if (isOccluded)
+        maxLimit = *std::max_element(limits, limits + numOfRays);
+      continue;
+    }
+    if (stackSize + Width > TRAVERSAL_STACK_SIZE)
+      continue;
+    const Node<Width> &node = nodes[entry.m_index];
+    float tNear[Width];
+    unsigned int mask = packetBoxIntersect(node, pd, maxLimit, tNear);
+    uint8_t firstRays[Width];
+    unsigned int pending = mask;
+    for (size_t j = entry.m_first; pending != 0 && j < numOfRays; ++j) {
+      if (occluded[j])
+        continue;
+      float rayNear[Width];
+      unsigned int entered =
+          boxIntersect(node, rd[j], limits[j], rayNear) & pending;
+      pending &= ~entered;
+      for (size_t i = 0; entered != 0; ++i, entered >>= 1)
+        if (entered & 1u)
+          firstRays[i] = uint8_t(j);
+    }
+    mask &= ~pending;
+    for (size_t i = 0; i < Width; ++i)
+      if ((mask & (1u << i)) && node.m_children[i] != EMPTY_SLOT)
+        stack[stackSize++] = {node.m_children[i], node.m_counts[i],
+                              firstRays[i], tNear[i]};
+  }
+}
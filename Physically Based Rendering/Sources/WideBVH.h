@@ -0,0 +1,113 @@
+// ----------------------------------------------
+// Polytechnique - INF584 "Image Synthesis"
+//
+// Base code for practical assignments.
+//
+// Copyright (C) 2020-2024 Tamy Boubekeur
+// All rights reserved.
+// ----------------------------------------------
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <limits>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "BVH.h"
+#include "Ray.h"
+
+/// A 4-wide or 8-wide BVH, obtained by collapsing a binary BVH. The bounds of the children of a node are
+/// stored as structure of arrays so that a ray is tested against all of them in a single SSE/AVX pass.
+/// Each leaf is a single pack of up to Width triangles, also stored as structure of arrays and tested in one pass.
+/// Hits reference the index pairs of the binary BVH, which must outlive this one.
+class WideBVH {
+public:
+    /// Child index of the unused slots of a node, which the traversals never push.
+    static const uint32_t EMPTY_SLOT = std::numeric_limits<uint32_t>::max();
+
+    template <size_t Width>
+    struct Node {
+        float m_bounds[6][Width];    ///< Min x, y, z then max x, y, z of each child.
+        uint32_t m_children[Width];  ///< Node index of an interior child, triangle pack index of a leaf child, EMPTY_SLOT if unused.
+        uint16_t m_counts[Width];    ///< Number of triangles of a leaf child, 0 for interior and empty children.
+    };
+
+    /// Triangles of a leaf, with the edges precomputed for the Moller-Trumbore test.
+    /// Unused lanes are degenerate (null edges) and never hit.
+    template <size_t Width>
+    struct TrianglePack {
+        float m_p0[3][Width];
+        float m_e1[3][Width];        ///< p1 - p0.
+        float m_e2[3][Width];        ///< p2 - p0.
+        uint32_t m_indices[Width];   ///< Index of each triangle in the index pairs of the binary BVH.
+    };
+
+    /// Collapses bvh into nodes of width 4 or 8.
+    WideBVH(const std::shared_ptr<const BVH> bvh, size_t width);
+
+    virtual ~WideBVH();
+
+    /// Widest node supported by the running CPU: 8 with AVX, 4 otherwise (SSE or scalar box tests).
+    static size_t preferredWidth();
+
+    /// Whether the box tests of the given width run with SIMD instructions on this CPU.
+    static bool isSIMDWidth(size_t width);
+
+    inline size_t width() const { return m_width; }
+
+    inline size_t numOfNodes() const { return (m_width == 8 ? m_nodes8.size() : m_nodes4.size()); }
+
+    inline size_t numOfLeaves() const { return (m_width == 8 ? m_packs8.size() : m_packs4.size()); }
+
+    /// Closest intersection of r with the triangles at a distance in ]0, tMax[, tMax being clipped to r.tMax().
+    bool intersect(const Ray& r, Hit& hit, float tMax = std::numeric_limits<float>::max()) const;
+
+    /// Occlusion query: true as soon as any triangle, other than the excluded one, is found at a distance in ]0, tMax[, tMax being clipped to r.tMax().
+    bool occluded(const Ray& r, float tMax = std::numeric_limits<float>::max(),
+                  size_t excludedMeshIndex = std::numeric_limits<size_t>::max(),
+                  size_t excludedTriangleIndex = std::numeric_limits<size_t>::max()) const;
+
+    /// Packet version of intersect, with the same contract as BVH::intersect for packets. The children of a node are
+    /// culled for the whole packet in one SIMD pass over their bounds, then each surviving child is only traversed by
+    /// the rays from the first one entering it.
+    void intersect(const Ray* rays, size_t numOfRays, Hit* hits, bool* found,
+                   float tMax = std::numeric_limits<float>::max()) const;
+
+    /// Packet version of occluded, with the same contract as BVH::occluded for packets.
+    void occluded(const Ray* rays, size_t numOfRays, const float* tMax, const size_t* excludedMeshIndices,
+                  const size_t* excludedTriangleIndices, bool* occluded) const;
+
+private:
+    /// Collapses the binary subtree rooted at binaryNodeIndex, given the (first triangle, number of triangles) range of
+    /// every binary subtree. Subtrees of at most Width triangles become leaves.
+    template <size_t Width>
+    uint32_t collapse(uint32_t binaryNodeIndex, const std::vector<std::pair<uint32_t, uint32_t> >& subtreeRanges,
+                      std::vector<Node<Width> >& nodes, std::vector<TrianglePack<Width> >& packs) const;
+
+    template <size_t Width>
+    bool intersect(const std::vector<Node<Width> >& nodes, const std::vector<TrianglePack<Width> >& packs,
+                   const Ray& r, Hit& hit, float tMax) const;
+
+    template <size_t Width>
+    bool occluded(const std::vector<Node<Width> >& nodes, const std::vector<TrianglePack<Width> >& packs,
+                  const Ray& r, float tMax, size_t excludedMeshIndex, size_t excludedTriangleIndex) const;
+
+    template <size_t Width>
+    void intersect(const std::vector<Node<Width> >& nodes, const std::vector<TrianglePack<Width> >& packs,
+                   const Ray* rays, size_t numOfRays, Hit* hits, bool* found, float tMax) const;
+
+    template <size_t Width>
+    void occluded(const std::vector<Node<Width> >& nodes, const std::vector<TrianglePack<Width> >& packs,
+                  const Ray* rays, size_t numOfRays, const float* tMax, const size_t* excludedMeshIndices,
+                  const size_t* excludedTriangleIndices, bool* occluded) const;
+
+    std::shared_ptr<const BVH> m_bvhPtr;
+    size_t m_width;
+    std::vector<Node<4> > m_nodes4;
+    std::vector<Node<8> > m_nodes8;
+    std::vector<TrianglePack<4> > m_packs4;
+    std::vector<TrianglePack<8> > m_packs8;
+};